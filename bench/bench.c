@@ -0,0 +1,68 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bench.h"
+
+#include <freertos/FreeRTOS.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_MIN_NS 200000000LL
+
+volatile uintptr_t bench_sink;
+
+static int64_t bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return bench_now_ns() / 1000;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = { ticks / 1000, ticks % 1000 * 1000000L };
+
+    nanosleep(&ts, NULL);
+}
+
+uint32_t bench_random()
+{
+    // xorshift32, so runs are repeatable
+    static uint32_t state = 2463534242u;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+double bench_run(const char *name, bench_fn_t fn, void *ctx)
+{
+    size_t iterations = 1;
+    int64_t elapsed;
+
+    for (;;) {
+        int64_t start = bench_now_ns();
+
+        fn(ctx, iterations);
+        elapsed = bench_now_ns() - start;
+
+        if (elapsed >= BENCH_MIN_NS) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    double ns = (double)elapsed / iterations;
+
+    printf("%-40s %10.1f ns/op\n", name, ns);
+
+    return ns;
+}
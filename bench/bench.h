@@ -0,0 +1,22 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __0f6a2f0e_4a53_4c21_9d0b_7e3c58a1b912__
+#define __0f6a2f0e_4a53_4c21_9d0b_7e3c58a1b912__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Host-side micro-benchmarks for the freestanding parts of src/.  Numbers are
+// for the build machine, not the ESP32; compare them against each other.
+
+typedef void (*bench_fn_t)(void *ctx, size_t iterations);
+
+// Runs fn with growing iteration counts until it takes long enough to time,
+// then prints and returns the nanoseconds per iteration
+double bench_run(const char *name, bench_fn_t fn, void *ctx);
+uint32_t bench_random();
+
+// Keeps the compiler from optimizing away a result
+extern volatile uintptr_t bench_sink;
+
+#endif
@@ -0,0 +1,137 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bench.h"
+#include "bbl_adv.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Classifying advertisements: the old chain of trying every decoder in turn
+// against bbl_adv_decode()'s single walk, per kind of advertisement and for a
+// mix where most of what a scanner hears isn't a beacon
+
+typedef struct sample sample_t;
+
+struct sample {
+    const char *name;
+    uint8_t len;
+    uint8_t data[62];
+};
+
+static const sample_t samples[] = {
+    { "ibeacon", 30, {
+        0x02, 0x01, 0x06, 0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15,
+        0xe2, 0xc5, 0x6d, 0xb5, 0xdf, 0xfb, 0x48, 0xd2, 0xb0, 0x60, 0xd0, 0xf5, 0xa7, 0x10, 0x96, 0xe0,
+        0x00, 0x01, 0x00, 0x2a, 0xc5,
+    } },
+    { "eddystone-uid", 31, {
+        0x02, 0x01, 0x06, 0x03, 0x03, 0xaa, 0xfe, 0x17, 0x16, 0xaa, 0xfe, 0x00, 0xeb,
+        0xed, 0xd3, 0x59, 0x0d, 0xc8, 0x3d, 0x3d, 0x92, 0x6a, 0x37,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+    } },
+    { "altbeacon", 31, {
+        0x02, 0x01, 0x06, 0x1b, 0xff, 0x18, 0x01, 0xbe, 0xac,
+        0xe2, 0xc5, 0x6d, 0xb5, 0xdf, 0xfb, 0x48, 0xd2, 0xb0, 0x60, 0xd0, 0xf5, 0xa7, 0x10, 0x96, 0xe0,
+        0x00, 0x01, 0x00, 0x2a, 0xc5, 0x00,
+    } },
+    // Apple Nearby Info plus a shortened name in the scan response
+    { "other", 22, {
+        0x02, 0x01, 0x1a, 0x0a, 0xff, 0x4c, 0x00, 0x10, 0x05, 0x0b, 0x1c, 0x6f, 0x3e, 0x41,
+        0x07, 0x08, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x00,
+    } },
+};
+
+#define SAMPLE_COUNT (sizeof(samples) / sizeof(samples[0]))
+#define MIX_SIZE 64
+
+static const sample_t *mix[MIX_SIZE];
+
+typedef struct adv_bench adv_bench_t;
+
+struct adv_bench {
+    const sample_t **samples;
+    size_t count;
+};
+
+static bbl_adv_type_t decode_chain(const uint8_t *data, uint8_t len)
+{
+    esp_ble_ibeacon_t ibeacon;
+    esp_eddystone_result_t eddystone;
+    esp_ble_altbeacon_t altbeacon;
+
+    // The old code left this uninitialised, which only worked by luck
+    memset(&eddystone.common, 0, sizeof(eddystone.common));
+
+    if (esp_ibeacon_decode(data, len, &ibeacon) == ESP_OK) {
+        return AdvTypeIBeacon;
+    } else if (esp_eddystone_decode(data, len, &eddystone) == ESP_OK) {
+        return AdvTypeEddystoneUID;
+    } else if (esp_altbeacon_decode(data, len, &altbeacon) == ESP_OK) {
+        return AdvTypeAltBeacon;
+    }
+
+    return AdvTypeOther;
+}
+
+static void bench_chain(void *ctx, size_t iterations)
+{
+    adv_bench_t *b = ctx;
+    uintptr_t types = 0;
+
+    for (size_t n = 0; n < iterations; ++n) {
+        const sample_t *s = b->samples[n % b->count];
+        types += decode_chain(s->data, s->len);
+    }
+
+    bench_sink = types;
+}
+
+static void bench_single_pass(void *ctx, size_t iterations)
+{
+    adv_bench_t *b = ctx;
+    uintptr_t types = 0;
+    bbl_adv_t adv;
+
+    for (size_t n = 0; n < iterations; ++n) {
+        const sample_t *s = b->samples[n % b->count];
+        types += bbl_adv_decode(s->data, s->len, &adv);
+    }
+
+    bench_sink = types;
+}
+
+static void bench_samples(const char *label, const sample_t **s, size_t count)
+{
+    adv_bench_t b = { s, count };
+    char name[64];
+
+    snprintf(name, sizeof(name), "adv %-13s decoder chain", label);
+    double chain = bench_run(name, bench_chain, &b);
+    snprintf(name, sizeof(name), "adv %-13s single pass", label);
+    double single = bench_run(name, bench_single_pass, &b);
+    printf("%-40s %10.1fx\n", "", chain / single);
+}
+
+int main()
+{
+    bbl_adv_t adv;
+
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+        const sample_t *s = &samples[i];
+
+        // The old chain only found AltBeacons that were the whole advertisement
+        if (decode_chain(s->data, s->len) != bbl_adv_decode(s->data, s->len, &adv)) {
+            printf("%s: only the single pass recognises it\n", s->name);
+        }
+
+        bench_samples(s->name, &s, 1);
+    }
+
+    // Three quarters of what a busy site hears isn't a beacon
+    for (size_t i = 0; i < MIX_SIZE; ++i) {
+        mix[i] = (i % 4 == 0) ? &samples[i / 4 % (SAMPLE_COUNT - 1)] : &samples[SAMPLE_COUNT - 1];
+    }
+    bench_samples("mix", mix, MIX_SIZE);
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bench.h"
+#include "bbl_cbor.h"
+#include "bbl_utils.h"
+
+#include <stdio.h>
+
+// An iBeacon report encoded the way publish_ibeacon() does it, as JSON and as
+// CBOR: encode time and payload size
+
+typedef struct report report_t;
+
+struct report {
+    const char *hostname;
+    uint8_t mac[6];
+    int rssi, rssi_count, rssi_min, rssi_max, rssi_mean, rssi_median;
+    uint8_t adv_data[62];
+    int adv_data_len;
+    char uuid[33];
+    uint16_t major, minor;
+    int8_t tx_power;
+};
+
+static size_t encode_json(const report_t *r, char *buf, size_t size)
+{
+    return bbl_snprintf(buf, size,
+        "{"
+            "\"hostname\":\"%js\","
+            "\"beacon_type\":\"ibeacon\","
+            "\"mac\":\"%.*hs\","
+            "\"rssi\":%d,"
+            "\"rssi_count\":%d,"
+            "\"rssi_min\":%d,"
+            "\"rssi_max\":%d,"
+            "\"rssi_mean\":%d,"
+            "\"rssi_median\":%d,"
+            "\"data\":\"%.*hs\","
+            "\"uuid\":\"%s\","
+            "\"major\":\"%04x\","
+            "\"minor\":\"%04x\","
+            "\"tx_power\":\"%02x\""
+        "}",
+        r->hostname,
+        sizeof(r->mac), r->mac,
+        r->rssi, r->rssi_count, r->rssi_min, r->rssi_max, r->rssi_mean, r->rssi_median,
+        r->adv_data_len, r->adv_data,
+        r->uuid,
+        r->major,
+        r->minor,
+        (uint8_t)r->tx_power
+    );
+}
+
+static size_t encode_cbor(const report_t *r, char *buf, size_t size)
+{
+    bbl_cbor_t cbor;
+
+    bbl_cbor_init(&cbor, buf, size);
+    bbl_cbor_map(&cbor, 13);
+    bbl_cbor_text(&cbor, "beacon_type");
+    bbl_cbor_text(&cbor, "ibeacon");
+    bbl_cbor_text(&cbor, "mac");
+    bbl_cbor_bytes(&cbor, r->mac, sizeof(r->mac));
+    bbl_cbor_text(&cbor, "rssi");
+    bbl_cbor_int(&cbor, r->rssi);
+    bbl_cbor_text(&cbor, "rssi_count");
+    bbl_cbor_uint(&cbor, r->rssi_count);
+    bbl_cbor_text(&cbor, "rssi_min");
+    bbl_cbor_int(&cbor, r->rssi_min);
+    bbl_cbor_text(&cbor, "rssi_max");
+    bbl_cbor_int(&cbor, r->rssi_max);
+    bbl_cbor_text(&cbor, "rssi_mean");
+    bbl_cbor_int(&cbor, r->rssi_mean);
+    bbl_cbor_text(&cbor, "rssi_median");
+    bbl_cbor_int(&cbor, r->rssi_median);
+    bbl_cbor_text(&cbor, "data");
+    bbl_cbor_bytes(&cbor, r->adv_data, r->adv_data_len);
+    bbl_cbor_text(&cbor, "uuid");
+    bbl_cbor_bytes(&cbor, r->adv_data + 9, 16);
+    bbl_cbor_text(&cbor, "major");
+    bbl_cbor_uint(&cbor, r->major);
+    bbl_cbor_text(&cbor, "minor");
+    bbl_cbor_uint(&cbor, r->minor);
+    bbl_cbor_text(&cbor, "tx_power");
+    bbl_cbor_int(&cbor, r->tx_power);
+
+    return cbor.overflow ? 0 : cbor.used;
+}
+
+static report_t report = {
+    .hostname = "bubbles-lobby-01",
+    .mac = { 0xc4, 0x7c, 0x8d, 0x6a, 0x21, 0x9e },
+    .rssi = -67, .rssi_count = 9, .rssi_min = -74, .rssi_max = -61, .rssi_mean = -67, .rssi_median = -66,
+    .adv_data = {
+        0x02, 0x01, 0x06, 0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15,
+        0xe2, 0xc5, 0x6d, 0xb5, 0xdf, 0xfb, 0x48, 0xd2, 0xb0, 0x60, 0xd0, 0xf5, 0xa7, 0x10, 0x96, 0xe0,
+        0x00, 0x01, 0x00, 0x2a, 0xc5,
+    },
+    .adv_data_len = 30,
+    .uuid = "e2c56db5dffb48d2b060d0f5a71096e0",
+    .major = 1, .minor = 42, .tx_power = -59,
+};
+
+static char buf[768];
+
+static void bench_json(void *ctx, size_t iterations)
+{
+    size_t total = 0;
+
+    for (size_t n = 0; n < iterations; ++n) {
+        total += encode_json(ctx, buf, sizeof(buf));
+    }
+
+    bench_sink = total;
+}
+
+static void bench_cbor(void *ctx, size_t iterations)
+{
+    size_t total = 0;
+
+    for (size_t n = 0; n < iterations; ++n) {
+        total += encode_cbor(ctx, buf, sizeof(buf));
+    }
+
+    bench_sink = total;
+}
+
+int main()
+{
+    printf("%-40s %10zu bytes\n", "ibeacon report json", encode_json(&report, buf, sizeof(buf)));
+    printf("%-40s %10zu bytes\n", "ibeacon report cbor", encode_cbor(&report, buf, sizeof(buf)));
+
+    double json = bench_run("ibeacon report json encode", bench_json, &report);
+    double cbor = bench_run("ibeacon report cbor encode", bench_cbor, &report);
+    printf("%-40s %10.1fx\n", "", json / cbor);
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bench.h"
+#include "bbl_mactable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Beacon lookups by MAC: the linear scan find_beacon() used to do against the
+// hash index it does now, for hits and for MACs not in the cache yet
+
+#define LOOKUPS 1024
+
+typedef struct mactable_bench mactable_bench_t;
+
+struct mactable_bench {
+    size_t count;
+    uint8_t (*macs)[6];
+    bbl_mactable_t table;
+    bbl_mactable_slot_t *slots;
+    uint8_t (*lookups)[6];
+};
+
+static void random_mac(uint8_t *mac)
+{
+    uint32_t a = bench_random();
+    uint32_t b = bench_random();
+
+    memcpy(mac, &a, 4);
+    memcpy(mac + 4, &b, 2);
+}
+
+static void bench_linear(void *ctx, size_t iterations)
+{
+    mactable_bench_t *b = ctx;
+    uintptr_t found = 0;
+
+    for (size_t n = 0; n < iterations; ++n) {
+        const uint8_t *mac = b->lookups[n % LOOKUPS];
+
+        for (size_t i = 0; i < b->count; ++i) {
+            if (memcmp(mac, b->macs[i], 6) == 0) {
+                found += i;
+                break;
+            }
+        }
+    }
+
+    bench_sink = found;
+}
+
+static void bench_index(void *ctx, size_t iterations)
+{
+    mactable_bench_t *b = ctx;
+    uintptr_t found = 0;
+
+    for (size_t n = 0; n < iterations; ++n) {
+        found += bbl_mactable_find(&b->table, b->lookups[n % LOOKUPS]);
+    }
+
+    bench_sink = found;
+}
+
+static void bench_size(size_t count)
+{
+    mactable_bench_t b;
+    char name[64];
+
+    b.count = count;
+    b.macs = malloc(count * sizeof(*b.macs));
+    b.slots = malloc(count * 2 * sizeof(*b.slots));
+    b.lookups = malloc(LOOKUPS * sizeof(*b.lookups));
+    bbl_mactable_init(&b.table, b.slots, count * 2);
+
+    for (size_t i = 0; i < count; ++i) {
+        random_mac(b.macs[i]);
+        bbl_mactable_insert(&b.table, b.macs[i], i);
+    }
+
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        memcpy(b.lookups[i], b.macs[bench_random() % count], 6);
+    }
+
+    snprintf(name, sizeof(name), "mactable %4zu hit  linear", count);
+    double linear = bench_run(name, bench_linear, &b);
+    snprintf(name, sizeof(name), "mactable %4zu hit  index", count);
+    double index = bench_run(name, bench_index, &b);
+    printf("%-40s %10.1fx\n", "", linear / index);
+
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        random_mac(b.lookups[i]);
+    }
+
+    snprintf(name, sizeof(name), "mactable %4zu miss linear", count);
+    linear = bench_run(name, bench_linear, &b);
+    snprintf(name, sizeof(name), "mactable %4zu miss index", count);
+    index = bench_run(name, bench_index, &b);
+    printf("%-40s %10.1fx\n", "", linear / index);
+
+    free(b.macs);
+    free(b.slots);
+    free(b.lookups);
+}
+
+int main()
+{
+    bench_size(16);
+    bench_size(64);
+    bench_size(256);
+    bench_size(1024);
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+
+# Checks the stats payload publish_stats() formats in src/bbl_ble.c: that the
+# format has exactly one argument per conversion, and that the longest
+# payload it can produce fits in STATS_PAYLOAD_MAX.  bbl_snprintf's own
+# conversions (%,u and friends) are beyond what the compiler can check.
+#
+#   bench/check_stats.py [path/to/bbl_ble.c]
+
+import os
+import re
+import sys
+
+CONVERSION = re.compile(r"%(0?)(,?)(\*|\d*)(?:\.(\*|\d+))?(hh|h|ll|l|j|z|t|L)?([a-zA-Z%])")
+
+def c_strings(text):
+    """Concatenates adjacent C string literals, as the compiler would."""
+    return "".join(bytes(s, "ascii").decode("unicode_escape") for s in re.findall(r'"((?:[^"\\]|\\.)*)"', text))
+
+def split_args(text):
+    """Splits a call's arguments at the top-level commas, up to its closing parenthesis."""
+    args, depth, start, in_string, escaped = [], 0, 0, False, False
+
+    for i, c in enumerate(text):
+        if escaped:
+            escaped = False
+        elif in_string:
+            escaped = c == "\\"
+            in_string = c != '"'
+        elif c == '"':
+            in_string = True
+        elif c in "([":
+            depth += 1
+        elif c in ")]":
+            if depth == 0:
+                args.append(text[start:i])
+                return [a.strip() for a in args if a.strip()]
+            depth -= 1
+        elif c == "," and depth == 0:
+            args.append(text[start:i])
+            start = i + 1
+
+    raise ValueError("unterminated call")
+
+def widest(fill, sep, width, length, kind):
+    """Longest text one conversion can produce."""
+    digits = 20 if length in ("ll", "j", "z", "t") else 10
+    if kind == "d":
+        digits += 1 if length in ("ll", "j", "z", "t") else 0
+    if kind in "xX":
+        digits = 16 if length in ("ll", "j", "z", "t") else 8
+    n = digits + (digits - 1) // 3 if sep else digits
+    n += 1 if kind == "d" else 0
+    return max(n, int(width) if width and width != "*" else 0)
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "..", "src", "bbl_ble.c")
+    source = open(path).read()
+
+    limit = int(re.search(r"#define STATS_PAYLOAD_MAX (\d+)", source).group(1))
+    body = source[source.index("static void publish_stats("):]
+    call = body[body.index("bbl_snprintf(payload, payload_size,") + len("bbl_snprintf("):]
+    args = split_args(call)
+    fmt = c_strings(args[2])
+    values = args[3:]
+
+    wanted = 0
+    longest = 0
+    last = 0
+    for m in CONVERSION.finditer(fmt):
+        fill, sep, width, precision, length, kind = m.groups()
+        longest += m.start() - last
+        last = m.end()
+        if kind == "%":
+            longest += 1
+            continue
+        if kind not in "udxX":
+            sys.exit("%s: can't size %%%s" % (path, kind))
+        wanted += 1 + (width == "*") + (precision == "*")
+        longest += widest(fill, sep, width, length, kind)
+    longest += len(fmt) - last
+
+    print("stats: %d conversions, %d arguments, at most %d of %d bytes" % (wanted, len(values), longest, limit))
+
+    if wanted != len(values):
+        sys.exit("%s: publish_stats() has %d conversions but %d arguments" % (path, wanted, len(values)))
+    # bbl_snprintf needs room for its terminator too
+    if longest + 1 > limit:
+        sys.exit("%s: the stats payload can reach %d bytes, STATS_PAYLOAD_MAX is %d" % (path, longest, limit))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,14 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __2debe602_d7b5_4003_be91_43256c714041__
+#define __2debe602_d7b5_4003_be91_43256c714041__
+
+// The error codes lib/beacon-parser returns, for host builds
+
+typedef int esp_err_t;
+
+#define ESP_OK              0
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_NOT_FOUND   0x105
+
+#endif
@@ -0,0 +1,19 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __489af720_5555_412e_be4e_d9b3975ee53f__
+#define __489af720_5555_412e_be4e_d9b3975ee53f__
+
+// The GAP constants lib/beacon-parser uses, for host builds
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define ESP_UUID_LEN_128                16
+
+#define ESP_BLE_AD_TYPE_FLAG            0x01
+#define ESP_BLE_AD_TYPE_16SRV_CMPL      0x03
+#define ESP_BLE_AD_TYPE_SERVICE_DATA    0x16
+
+#endif
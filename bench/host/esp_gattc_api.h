@@ -0,0 +1,8 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __10bbc433_9716_4537_a798_c513b94193ac__
+#define __10bbc433_9716_4537_a798_c513b94193ac__
+
+// Included by lib/beacon-parser, which uses nothing from it
+
+#endif
@@ -0,0 +1,22 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __5ba67460_6e2b_4f10_8b3d_802374eb751c__
+#define __5ba67460_6e2b_4f10_8b3d_802374eb751c__
+
+// Just enough of FreeRTOS and esp_timer for bbl_utils.c to build on the host,
+// implemented in bench.c
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define portTICK_PERIOD_MS 1
+
+typedef uint32_t TickType_t;
+
+int64_t esp_timer_get_time(void);
+void vTaskDelay(TickType_t ticks);
+
+#endif
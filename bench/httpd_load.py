@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+
+# Load test for the HTTP server's select() loop.  Times GETs on a keep-alive
+# connection on their own, then with clients that have sent half a request
+# and gone quiet holding the other slots, then from several clients at once.
+#
+#   bench/httpd_load.py <host>[:<port>] [path] [--slow N] [--clients N] [--requests N]
+
+import argparse
+import socket
+import threading
+import time
+
+def connect(host, port):
+    sock = socket.create_connection((host, port), timeout=30)
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return sock
+
+def read_until(sock, buf, marker):
+    while marker not in buf:
+        data = sock.recv(4096)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+
+    return buf.partition(marker)
+
+def read_bytes(sock, buf, length):
+    while len(buf) < length:
+        data = sock.recv(4096)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+
+    return buf[:length], buf[length:]
+
+# Returns the status and whatever was read past the end of the response
+def read_response(sock, buf):
+    head, _, buf = read_until(sock, buf, b"\r\n\r\n")
+    status = int(head.split(b" ", 2)[1])
+    length = 0
+    chunked = False
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        name = name.strip().lower()
+        if name == b"content-length":
+            length = int(value)
+        elif name == b"transfer-encoding":
+            chunked = b"chunked" in value.lower()
+
+    if not chunked:
+        _, buf = read_bytes(sock, buf, length)
+        return status, buf
+
+    # /metrics is streamed; each chunk is its size in hex, then the data, both ending in CRLF
+    while True:
+        size, _, buf = read_until(sock, buf, b"\r\n")
+        _, buf = read_bytes(sock, buf, int(size, 16) + 2)
+        if int(size, 16) == 0:
+            return status, buf
+
+def timed_gets(host, port, path, count):
+    request = ("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (path, host)).encode()
+    sock = connect(host, port)
+    buf = b""
+    times = []
+
+    for _ in range(count):
+        start = time.perf_counter()
+        sock.sendall(request)
+        status, buf = read_response(sock, buf)
+        times.append(time.perf_counter() - start)
+        if status != 200:
+            raise IOError("status %d" % status)
+
+    sock.close()
+    return times
+
+def percentile(times, p):
+    times = sorted(times)
+    return times[min(len(times) - 1, int(len(times) * p / 100))] * 1000
+
+def report(label, times, elapsed=None):
+    line = "%-32s %6d requests  p50 %7.2f ms  p99 %7.2f ms" % (label, len(times), percentile(times, 50), percentile(times, 99))
+    if elapsed:
+        line += "  %8.0f req/s" % (len(times) / elapsed)
+    print(line)
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("address")
+    parser.add_argument("path", nargs="?", default="/")
+    parser.add_argument("--slow", type=int, default=3, help="stalled clients, at most one fewer than the slots")
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--requests", type=int, default=200)
+    args = parser.parse_args()
+
+    host, _, port = args.address.partition(":")
+    port = int(port or 80)
+
+    report("one client", timed_gets(host, port, args.path, args.requests))
+
+    # Half a request line each, then nothing until the idle timeout drops them
+    stalled = []
+    for _ in range(args.slow):
+        sock = connect(host, port)
+        sock.sendall(("GET %s HTTP/1.1\r\nHo" % args.path).encode())
+        stalled.append(sock)
+    time.sleep(0.2)
+    report("one client, %d stalled" % args.slow, timed_gets(host, port, args.path, args.requests))
+    for sock in stalled:
+        sock.close()
+    time.sleep(0.2)
+
+    results = [None] * args.clients
+    def worker(i):
+        results[i] = timed_gets(host, port, args.path, args.requests)
+
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(args.clients)]
+    start = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - start
+
+    report("%d clients at once" % args.clients, sum(results, []), elapsed)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+
+# Test for firmware uploads to POST /firmware.  Checks that a request with
+# neither a Content-Length nor a chunked body gets a 411, then uploads the
+# image chunked.  Unless --flash is given the upload carries a wrong
+# SHA-256, so the node receives and hashes the whole body, answers 400 and
+# keeps running the image it has.  The node has to be in config mode.
+#
+#   bench/ota_upload.py <host>[:<port>] <image> [--chunk N] [--sized] [--flash]
+
+import argparse
+import hashlib
+import json
+import time
+
+from httpd_load import connect, read_bytes, read_until
+
+def request(sock, method, path, host, headers, body=b""):
+    head = "%s %s HTTP/1.1\r\nHost: %s\r\n" % (method, path, host)
+    head += "".join("%s: %s\r\n" % header for header in headers)
+    sock.sendall((head + "\r\n").encode() + body)
+
+# Returns the status and the body, for the error message
+def response(sock):
+    head, _, buf = read_until(sock, b"", b"\r\n\r\n")
+    status = int(head.split(b" ", 2)[1])
+    length = 0
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            length = int(value)
+
+    body, _ = read_bytes(sock, buf, length)
+    return status, body.decode(errors="replace")
+
+def expect(label, status, body, wanted):
+    print("%-32s %d %s" % (label, status, body))
+    if status != wanted:
+        raise SystemExit("%s: wanted %d" % (label, wanted))
+
+def upload_state(host, port):
+    sock = connect(host, port)
+    request(sock, "GET", "/firmware", host, [])
+    status, body = response(sock)
+    sock.close()
+    return json.loads(body)
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("address")
+    parser.add_argument("image")
+    parser.add_argument("--chunk", type=int, default=1460, help="bytes per chunk")
+    parser.add_argument("--sized", action="store_true", help="send X-Firmware-Size so only the image's size is erased")
+    parser.add_argument("--flash", action="store_true", help="send the right SHA-256, so the node boots the image")
+    args = parser.parse_args()
+
+    host, _, port = args.address.partition(":")
+    port = int(port or 80)
+    image = open(args.image, "rb").read()
+    digest = hashlib.sha256(image).hexdigest()
+    if not args.flash:
+        digest = hashlib.sha256(digest.encode()).hexdigest()
+
+    sock = connect(host, port)
+    request(sock, "POST", "/firmware", host, [("X-Firmware-SHA256", digest)])
+    status, body = response(sock)
+    sock.close()
+    expect("no Content-Length, not chunked", status, body, 411)
+
+    headers = [("X-Firmware-SHA256", digest), ("Transfer-Encoding", "chunked")]
+    if args.sized:
+        headers.append(("X-Firmware-Size", str(len(image))))
+
+    start = time.perf_counter()
+    sock = connect(host, port)
+    request(sock, "POST", "/firmware", host, headers)
+    for i in range(0, len(image), args.chunk):
+        chunk = image[i:i + args.chunk]
+        sock.sendall(b"%x\r\n" % len(chunk) + chunk + b"\r\n")
+    sock.sendall(b"0\r\n\r\n")
+    status, body = response(sock)
+    sock.close()
+    elapsed = time.perf_counter() - start
+
+    expect("chunked, %d bytes in %.1f s" % (len(image), elapsed), status, body, 200 if args.flash else 400)
+    if args.flash:
+        return
+
+    state = upload_state(host, port)
+    print("%-32s %s" % ("GET /firmware", json.dumps(state)))
+    if state["received"] != len(image) or state["total"] != (len(image) if args.sized else 0):
+        raise SystemExit("wanted %d bytes received" % len(image))
+
+if __name__ == "__main__":
+    main()
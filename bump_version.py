@@ -1,6 +1,8 @@
 #!/usr/bin/env python
 
+import gzip
 import hashlib
+import io
 import os
 import sys
 
@@ -10,6 +12,9 @@ VERSION_LEVELS  = ["major", "minor", "rev", "patch"]
 # TODO: Get from sys.argv
 bump = None
 
+# Resources also embedded gzipped, for clients that accept it
+GZIP_RESOURCES = ["res/index.html"]
+
 def update_version(file):
     lines = []
 
@@ -43,6 +48,24 @@ def hash_files(dir, skip=[]):
 
     return '"%s"' % hash.hexdigest()
 
+def gzip_resource(file):
+    with open(file, "rb") as fp:
+        data = fp.read()
+
+    # No timestamp, so the output only changes when the resource does
+    buf = io.BytesIO()
+    with gzip.GzipFile(filename="", mode="wb", fileobj=buf, compresslevel=9, mtime=0) as gz:
+        gz.write(data)
+
+    gz_file = file + ".gz"
+    if os.path.exists(gz_file):
+        with open(gz_file, "rb") as fp:
+            if fp.read() == buf.getvalue():
+                return
+
+    with open(gz_file, "wb") as fp:
+        fp.write(buf.getvalue())
+
 def update_hash(file, tag, hash):
     prefix = "#define %s" % tag
     lines = []
@@ -65,5 +88,8 @@ else:
     src_hash = hash_files("src", ["bbl_version.h", "bbl_httpd_resources.h"])
     update_hash("src/bbl_version.h", "BBL_SOURCE_HASH", src_hash)
 
-    httpd_res_hash = hash_files("res")
+    for file in GZIP_RESOURCES:
+        gzip_resource(file)
+
+    httpd_res_hash = hash_files("res", [os.path.basename(file) + ".gz" for file in GZIP_RESOURCES])
     update_hash("src/bbl_httpd_resources.h", "BBL_HTTPD_RESOURCES_HASH", httpd_res_hash)
@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+
+# Decodes CBOR beacon payloads published when the encoding option is enabled
+# and prints them as JSON, with byte strings rendered as hex like the JSON
+# payloads.  Reads each file named on the command line, or stdin.
+
+import binascii
+import json
+import struct
+import sys
+
+BREAK = object()
+
+def decode_argument(data, pos, info):
+    if info < 24:
+        return info, pos
+    if info == 24:
+        return struct.unpack_from(">B", data, pos)[0], pos + 1
+    if info == 25:
+        return struct.unpack_from(">H", data, pos)[0], pos + 2
+    if info == 26:
+        return struct.unpack_from(">I", data, pos)[0], pos + 4
+    if info == 27:
+        return struct.unpack_from(">Q", data, pos)[0], pos + 8
+    if info == 31:
+        return None, pos
+
+    raise ValueError("invalid additional info %d at offset %d" % (info, pos - 1))
+
+def decode_item(data, pos=0):
+    initial = bytearray(data[pos:pos+1])[0]
+    major, info = initial >> 5, initial & 0x1f
+    pos += 1
+
+    if initial == 0xff:
+        return BREAK, pos
+
+    arg, pos = decode_argument(data, pos, info)
+
+    if major == 0:
+        return arg, pos
+    if major == 1:
+        return -1 - arg, pos
+    if major == 2:
+        return binascii.hexlify(data[pos:pos+arg]).decode("ascii"), pos + arg
+    if major == 3:
+        return data[pos:pos+arg].decode("utf-8"), pos + arg
+    if major == 4:
+        items = []
+        while arg is None or len(items) < arg:
+            item, pos = decode_item(data, pos)
+            if item is BREAK:
+                break
+            items.append(item)
+        return items, pos
+    if major == 5:
+        pairs = {}
+        while arg is None or len(pairs) < arg:
+            key, pos = decode_item(data, pos)
+            if key is BREAK:
+                break
+            pairs[key], pos = decode_item(data, pos)
+        return pairs, pos
+
+    raise ValueError("unsupported major type %d at offset %d" % (major, pos - 1))
+
+def decode(data):
+    item, pos = decode_item(data)
+
+    if pos != len(data):
+        raise ValueError("%d trailing bytes" % (len(data) - pos))
+
+    return item
+
+if __name__ == "__main__":
+    files = sys.argv[1:] or [None]
+
+    for name in files:
+        if name is None:
+            data = getattr(sys.stdin, "buffer", sys.stdin).read()
+        else:
+            with open(name, "rb") as fp:
+                data = fp.read()
+
+        print(json.dumps(decode(data), indent=2, sort_keys=True))
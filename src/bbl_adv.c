@@ -0,0 +1,107 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_adv.h"
+
+#include <string.h>
+
+#define AD_TYPE_SERVICE_DATA_16 0x16
+#define AD_TYPE_MANUFACTURER    0xff
+
+#define APPLE_COMPANY_ID        0x004c
+#define IBEACON_SUBTYPE         0x02
+#define IBEACON_SUBTYPE_LEN     0x15
+#define ALTBEACON_CODE          0xbeac
+
+// Length of each AD structure including its length byte, as the decoders expect it
+#define IBEACON_AD_LEN          (sizeof(esp_ble_ibeacon_t) - 3)
+#define ALTBEACON_AD_LEN        28
+#define EDDYSTONE_UID_AD_LEN    (5 + EDDYSTONE_UID_DATA_LEN)
+
+static bbl_adv_type_t classify_manufacturer(const uint8_t *ad, size_t ad_len)
+{
+    if (ad_len == IBEACON_AD_LEN && little_endian_read_16(ad, 2) == APPLE_COMPANY_ID &&
+        ad[4] == IBEACON_SUBTYPE && ad[5] == IBEACON_SUBTYPE_LEN)
+    {
+        return AdvTypeIBeacon;
+    }
+
+    if (ad_len == ALTBEACON_AD_LEN && big_endian_read_16(ad, 4) == ALTBEACON_CODE) {
+        return AdvTypeAltBeacon;
+    }
+
+    return AdvTypeOther;
+}
+
+static bbl_adv_type_t classify_service_data(const uint8_t *ad, size_t ad_len)
+{
+    // The RFU bytes after the instance are optional
+    if ((ad_len == EDDYSTONE_UID_AD_LEN || ad_len == EDDYSTONE_UID_AD_LEN + EDDYSTONE_UID_RFU_LEN) &&
+        little_endian_read_16(ad, 2) == EDDYSTONE_SERVICE_UUID && ad[4] == EDDYSTONE_FRAME_TYPE_UID)
+    {
+        return AdvTypeEddystoneUID;
+    }
+
+    return AdvTypeOther;
+}
+
+bbl_adv_type_t bbl_adv_decode(const uint8_t *data, size_t len, bbl_adv_t *adv)
+{
+    const uint8_t *ad = NULL;
+    size_t ad_len = 0;
+
+    adv->type = AdvTypeOther;
+    adv->offset = 0;
+
+    // A zero length byte marks the end of the significant data
+    for (size_t pos = 0; pos < len && data[pos] != 0; pos += data[pos] + 1) {
+        size_t field_len = data[pos] + 1;
+
+        if (pos + field_len > len || field_len < 2) {
+            break;
+        }
+
+        if (data[pos + 1] == AD_TYPE_MANUFACTURER && field_len >= 4) {
+            adv->type = classify_manufacturer(data + pos, field_len);
+        } else if (data[pos + 1] == AD_TYPE_SERVICE_DATA_16 && field_len >= 5) {
+            adv->type = classify_service_data(data + pos, field_len);
+        }
+
+        if (adv->type != AdvTypeOther) {
+            ad = data + pos;
+            ad_len = field_len;
+            adv->offset = pos;
+            break;
+        }
+    }
+
+    // Hand the decoder just the matching AD structure, wherever it appeared
+    switch (adv->type) {
+    case AdvTypeIBeacon:
+        if (esp_ibeacon_decode(ad, ad_len, &adv->ibeacon) != ESP_OK) {
+            adv->type = AdvTypeOther;
+            adv->offset = 0;
+        }
+        break;
+
+    case AdvTypeEddystoneUID:
+        // The decoder loops on the common fields of its result, so they have to start out clear
+        memset(&adv->eddystone.common, 0, sizeof(adv->eddystone.common));
+        if (esp_eddystone_decode(ad, ad_len, &adv->eddystone) != ESP_OK) {
+            adv->type = AdvTypeOther;
+            adv->offset = 0;
+        }
+        break;
+
+    case AdvTypeAltBeacon:
+        if (esp_altbeacon_decode(ad, ad_len, &adv->altbeacon) != ESP_OK) {
+            adv->type = AdvTypeOther;
+            adv->offset = 0;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return adv->type;
+}
@@ -0,0 +1,38 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __7c0d5e2a_3b61_4f8e_9a47_d2c18f5b6e03__
+#define __7c0d5e2a_3b61_4f8e_9a47_d2c18f5b6e03__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_ibeacon_api.h"
+#include "esp_eddystone_api.h"
+#include "esp_altbeacon_api.h"
+
+// Classifies an advertisement (plus scan response) in a single walk over its
+// AD structures, then runs only the decoder for the beacon format it found.
+
+typedef enum bbl_adv_type bbl_adv_type_t;
+typedef struct bbl_adv bbl_adv_t;
+
+enum bbl_adv_type {
+    AdvTypeOther,
+    AdvTypeIBeacon,
+    AdvTypeEddystoneUID,
+    AdvTypeAltBeacon,
+};
+
+struct bbl_adv {
+    bbl_adv_type_t type;
+    uint8_t offset;     // Start of the AD structure the decoder was given
+    union {
+        esp_ble_ibeacon_t ibeacon;
+        esp_eddystone_result_t eddystone;
+        esp_ble_altbeacon_t altbeacon;
+    };
+};
+
+bbl_adv_type_t bbl_adv_decode(const uint8_t *data, size_t len, bbl_adv_t *adv);
+
+#endif
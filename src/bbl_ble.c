@@ -1,35 +1,144 @@
 // Copyright (C) Jonathan Kolb
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <esp_bt.h>
 #include <esp_gap_ble_api.h>
 #include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <stdlib.h>
 
-#include "esp_ibeacon_api.h"
-#include "esp_eddystone_api.h"
-#include "esp_altbeacon_api.h"
-
+#include "bbl_ble.h"
 #include "bbl_mqtt.h"
+#include "bbl_adv.h"
+#include "bbl_cbor.h"
 #include "bbl_config.h"
+#include "bbl_mactable.h"
+#include "bbl_ring.h"
+#include "bbl_spool.h"
 #include "bbl_utils.h"
+#include "bbl_log.h"
 
 #ifndef BBL_PUBLISH_STATS
     #define BBL_PUBLISH_STATS 0
 #endif
-#define BLE_BEACON_CACHE_SIZE 64
+// Per generation; must be a power of two, the MAC index uses twice as many slots.  With the index,
+// the eviction heap and the advertisement arena each entry takes 88 bytes per generation, so the
+// default costs 88 KiB of DRAM.
+#ifndef BBL_BEACON_CACHE_SIZE
+    #define BBL_BEACON_CACHE_SIZE 512
+#endif
+// Advertisement bytes kept per cache entry, on average.  An iBeacon or Eddystone advertisement is
+// about 30 bytes, with a scan response up to 62.
+#ifndef BBL_BEACON_ADV_BYTES
+    #define BBL_BEACON_ADV_BYTES 32
+#endif
+// When the cache is full, evict the least recently seen beacon instead of the weakest
+#ifndef BBL_BEACON_CACHE_EVICT_OLDEST
+    #define BBL_BEACON_CACHE_EVICT_OLDEST 0
+#endif
+// Advertisements buffered between the GAP callback and the publisher task, must be a power of two
+#ifndef BBL_BLE_RING_SIZE
+    #define BBL_BLE_RING_SIZE 64
+#endif
+#define BLE_RING_POLL_MS 50
+#define BLE_SCAN_WINDOW_SEC 1
+#define BLE_MIN_REPORT_INTERVAL_MS 100
+// Scan interval and window limits, in 0.625 ms units
+#define BLE_SCAN_UNITS_MIN 0x0004
+#define BLE_SCAN_UNITS_MAX 0x4000
+#define BLE_RSSI_MEDIAN_WINDOW 8
+#define BLE_BATCH_BUFSIZ 4096
+#define BEACON_UUID_LEN 16
+// iBeacon and AltBeacon IDs and the Eddystone namespace all start 6 bytes into their AD structure
+#define BEACON_ID_AD_OFFSET 6
+// Beacons remembered for change suppression, must be a power of two
+#ifndef BBL_BEACON_HISTORY_SIZE
+    #define BBL_BEACON_HISTORY_SIZE 128
+#endif
 #define STATS_INTERVAL_SEC 60
 
+BBL_STATIC_ASSERT((BBL_BEACON_CACHE_SIZE & (BBL_BEACON_CACHE_SIZE - 1)) == 0);
+BBL_STATIC_ASSERT(BBL_BEACON_CACHE_SIZE < BBL_MACTABLE_EMPTY);
+BBL_STATIC_ASSERT((BBL_BLE_RING_SIZE & (BBL_BLE_RING_SIZE - 1)) == 0);
+BBL_STATIC_ASSERT((BBL_BEACON_HISTORY_SIZE & (BBL_BEACON_HISTORY_SIZE - 1)) == 0);
+BBL_STATIC_ASSERT(BBL_BEACON_HISTORY_SIZE < BBL_MACTABLE_EMPTY);
+
 typedef struct ble_scan_result_evt_param ble_scan_result_evt_param_t;
 typedef struct beacon beacon_t;
+typedef struct beacon_cache beacon_cache_t;
+typedef struct ble_adv_record ble_adv_record_t;
+typedef struct beacon_identity beacon_identity_t;
+typedef struct beacon_history beacon_history_t;
 
-struct beacon {
+// What the GAP callback hands to the publisher task for each advertisement
+struct ble_adv_record {
     uint8_t mac[6];
-    int rssi;
+    int8_t rssi;
+    uint8_t adv_data_len;
     uint8_t adv_data[BBL_SIZEOF_FIELD(ble_scan_result_evt_param_t, ble_adv)];
-    int adv_data_len;
 };
 
-static const esp_ble_scan_params_t ble_scan_params = {
+// 36 bytes on the ESP32, ordered so the byte-sized fields pack together
+struct beacon {
+    uint8_t mac[6];
+    int8_t rssi;
+    uint8_t adv_data_len;
+    uint8_t adv_data_cap;       // Room reserved for adv_data in the arena
+
+    // RSSI aggregate over the current report window
+    int8_t rssi_min;
+    int8_t rssi_max;
+    int8_t rssi_recent[BLE_RSSI_MEDIAN_WINDOW];
+    int rssi_count;
+    int rssi_sum;
+
+    uint32_t last_seen;
+    uint8_t *adv_data;          // The latest advertisement, in the generation's arena
+};
+
+struct beacon_cache {
+    beacon_t beacons[BBL_BEACON_CACHE_SIZE];
+    int count;
+
+    // Advertisements are only as long as they need to be, so most of the room a full 62 bytes
+    // per beacon would take is left over for more beacons
+    uint8_t adv_arena[BBL_BEACON_CACHE_SIZE * BBL_BEACON_ADV_BYTES];
+    size_t adv_used;
+
+    bbl_mactable_t index;
+    bbl_mactable_slot_t index_slots[BBL_BEACON_CACHE_SIZE * 2];
+
+    // Min-heap of beacon indexes by eviction order, only kept once the cache is full
+    bool heap_valid;
+    uint16_t heap[BBL_BEACON_CACHE_SIZE];
+    uint16_t heap_pos[BBL_BEACON_CACHE_SIZE];
+};
+
+// Decoded beacon type and pre-rendered identity, reused until the adv_data changes
+struct beacon_identity {
+    uint32_t adv_hash;
+    bool decoded;
+    uint8_t type;           // bbl_adv_type_t
+    uint8_t id_offset;      // Raw UUID or namespace within adv_data
+    int8_t tx_power;
+    uint16_t major;
+    uint16_t minor;
+    char id[BEACON_UUID_LEN * 2 + 1];                   // UUID or namespace as hex
+    char instance[EDDYSTONE_UID_INSTANCE_LEN * 2 + 1];  // Eddystone instance as hex
+};
+
+// What was last published for a beacon, kept across report windows
+struct beacon_history {
+    uint8_t mac[6];
+    int8_t rssi;
+    uint32_t adv_hash;
+    uint32_t published;
+    beacon_identity_t identity;
+};
+
+// Interval and window come from the config, see ble_apply_config()
+static esp_ble_scan_params_t ble_scan_params = {
     .scan_type              = BLE_SCAN_TYPE_ACTIVE,
     .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
     .scan_filter_policy     = BLE_SCAN_FILTER_ALLOW_ALL,
@@ -48,220 +157,688 @@ uint raw_published;
 uint ibeacon_published;
 uint eddystone_published;
 uint publishing_errors;
+uint beacons_evicted;
+uint beacons_dropped;
+uint beacons_suppressed;
+uint batches_published;
+uint identities_reused;
+uint advertisements_filtered;
+bool scan_active;
+uint32_t scan_started_millis;
+uint32_t scan_millis;
+uint32_t stats_scan_millis;
 #define INC_STAT(stat) ++stat
 #else
 #define INC_STAT(stat)
 #endif
 
-static beacon_t beacon_cache[BLE_BEACON_CACHE_SIZE];
-int beacon_cache_count = 0;
+// The GAP records feed the active generation while the other one is being published
+static beacon_cache_t beacon_caches[2];
+static int beacon_generation;
+static ble_adv_record_t ble_adv_records[BBL_BLE_RING_SIZE];
+static bbl_ring_t ble_adv_ring;
+static TaskHandle_t ble_publish_task;
+static uint32_t ble_scan_duration;
+static esp_timer_handle_t ble_report_timer;
+static int ble_min_rssi;
+// Set by bbl_ble_reconfigure() until the scan has stopped, or until the next window boundary
+// when it couldn't be stopped
+static volatile bool ble_reconfigure_requested;
+// Set by the GAP callback once a reconfigure has stopped the scan, the publisher applies it
+static volatile bool ble_reconfigure_pending;
+
+// Only touched by the publisher task
+// Latched for each report window, since a command can change the config while a batch is open
+static bbl_encoding_t ble_encoding;
+static size_t ble_batch_max;
+static char ble_batch_topic[128];
+static size_t ble_batch_topic_len;
+static char ble_batch_buf[BLE_BATCH_BUFSIZ];
+static size_t ble_batch_used;
+static size_t ble_batch_reports;
+static beacon_history_t beacon_history[BBL_BEACON_HISTORY_SIZE];
+static int beacon_history_count;
+static bbl_mactable_t beacon_history_index;
+static bbl_mactable_slot_t beacon_history_slots[BBL_BEACON_HISTORY_SIZE * 2];
+
+static void beacon_cache_reset(beacon_cache_t *cache)
+{
+    bbl_mactable_clear(&cache->index);
+    cache->count = 0;
+    cache->adv_used = 0;
+    cache->heap_valid = false;
+}
+
+// Makes sure the beacon has room for an advertisement of this length.  Room it outgrows isn't
+// reused until the generation is reset.
+static bool beacon_reserve_adv(beacon_cache_t *cache, beacon_t *beacon, size_t length)
+{
+    if (length <= beacon->adv_data_cap) {
+        return true;
+    }
+
+    if (cache->adv_used + length > sizeof(cache->adv_arena)) {
+        return false;
+    }
+
+    beacon->adv_data = &cache->adv_arena[cache->adv_used];
+    beacon->adv_data_cap = length;
+    cache->adv_used += length;
+    return true;
+}
+
+// Whether a should be evicted before b
+static bool beacon_evicts_before(const beacon_t *a, const beacon_t *b)
+{
+#if BBL_BEACON_CACHE_EVICT_OLDEST
+    return (int32_t)(a->last_seen - b->last_seen) < 0;
+#else
+    return a->rssi_max < b->rssi_max;
+#endif
+}
+
+// Eviction keys only ever grow (rssi_max and last_seen both move one way within a window, and a
+// replacement is always stronger or newer than its victim), so entries only need to sift down
+static void beacon_heap_sift_down(beacon_cache_t *cache, int pos)
+{
+    uint16_t idx = cache->heap[pos];
+
+    for (;;) {
+        int child = 2 * pos + 1;
+
+        if (child >= cache->count) {
+            break;
+        }
+        if (child + 1 < cache->count && beacon_evicts_before(&cache->beacons[cache->heap[child + 1]], &cache->beacons[cache->heap[child]])) {
+            ++child;
+        }
+        if (!beacon_evicts_before(&cache->beacons[cache->heap[child]], &cache->beacons[idx])) {
+            break;
+        }
+
+        cache->heap[pos] = cache->heap[child];
+        cache->heap_pos[cache->heap[pos]] = pos;
+        pos = child;
+    }
+
+    cache->heap[pos] = idx;
+    cache->heap_pos[idx] = pos;
+}
+
+// Called after a beacon's RSSI or last_seen changed, keeps the next victim at the top of the heap
+static void beacon_cache_touch(beacon_cache_t *cache, const beacon_t *beacon)
+{
+    if (cache->count < BBL_BEACON_CACHE_SIZE) {
+        return;
+    }
+
+    if (!cache->heap_valid) {
+        // Just filled up
+        for (int i = 0; i < cache->count; ++i) {
+            cache->heap[i] = i;
+            cache->heap_pos[i] = i;
+        }
+        for (int i = cache->count / 2 - 1; i >= 0; --i) {
+            beacon_heap_sift_down(cache, i);
+        }
+        cache->heap_valid = true;
+        return;
+    }
+
+    beacon_heap_sift_down(cache, cache->heap_pos[beacon - cache->beacons]);
+}
 
-static beacon_t *find_beacon(ble_scan_result_evt_param_t *d)
+static beacon_t *find_beacon(beacon_cache_t *cache, const ble_adv_record_t *d)
 {
-    for (int i = 0; i < beacon_cache_count; ++i) {
-        if (memcmp(d->bda, beacon_cache[i].mac, sizeof(d->bda)) == 0) {
-            return &beacon_cache[i];
+    uint16_t idx = bbl_mactable_find(&cache->index, d->mac);
+
+    if (idx != BBL_MACTABLE_EMPTY) {
+        return &cache->beacons[idx];
+    }
+
+    if (cache->count < BBL_BEACON_CACHE_SIZE) {
+        idx = cache->count;
+        cache->beacons[idx].adv_data_cap = 0;
+    } else {
+        idx = cache->heap[0];
+#if !BBL_BEACON_CACHE_EVICT_OLDEST
+        if (d->rssi <= cache->beacons[idx].rssi_max) {
+            // Weaker than anything we already hold, keep what we have
+            INC_STAT(beacons_dropped);
+            return NULL;
         }
+#endif
+    }
+
+    beacon_t *result = &cache->beacons[idx];
+
+    // A replacement takes over its victim's room in the arena
+    if (!beacon_reserve_adv(cache, result, d->adv_data_len)) {
+        INC_STAT(beacons_dropped);
+        return NULL;
     }
 
-    if (beacon_cache_count == BLE_BEACON_CACHE_SIZE) {
-        --beacon_cache_count;
+    if (idx == cache->count) {
+        ++cache->count;
+    } else {
+        bbl_mactable_remove(&cache->index, result->mac);
+        INC_STAT(beacons_evicted);
     }
 
-    beacon_t *result = &beacon_cache[beacon_cache_count++];
-    memcpy(result->mac, d->bda, sizeof(result->mac));
+    memcpy(result->mac, d->mac, sizeof(result->mac));
+    result->rssi_count = 0;
+    bbl_mactable_insert(&cache->index, result->mac, idx);
     return result;
 }
 
+static void beacon_add_rssi(beacon_t *beacon, int rssi)
+{
+    if (beacon->rssi_count == 0) {
+        beacon->rssi_sum = 0;
+        beacon->rssi_min = rssi;
+        beacon->rssi_max = rssi;
+    } else if (rssi < beacon->rssi_min) {
+        beacon->rssi_min = rssi;
+    } else if (rssi > beacon->rssi_max) {
+        beacon->rssi_max = rssi;
+    }
+
+    beacon->rssi = rssi;
+    beacon->rssi_sum += rssi;
+    beacon->rssi_recent[beacon->rssi_count++ % BLE_RSSI_MEDIAN_WINDOW] = rssi;
+}
+
+static int beacon_rssi_mean(const beacon_t *beacon)
+{
+    int count = beacon->rssi_count;
+    int sum = beacon->rssi_sum;
+
+    // Round to nearest; RSSI sums are almost always negative
+    return (2 * sum + (sum < 0 ? -count : count)) / (2 * count);
+}
+
+static int beacon_rssi_median(const beacon_t *beacon)
+{
+    int8_t sorted[BLE_RSSI_MEDIAN_WINDOW];
+    int n = beacon->rssi_count < BLE_RSSI_MEDIAN_WINDOW ? beacon->rssi_count : BLE_RSSI_MEDIAN_WINDOW;
+
+    for (int i = 0; i < n; ++i) {
+        int8_t v = beacon->rssi_recent[i];
+        int j = i;
+
+        for (; j > 0 && sorted[j - 1] > v; --j) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = v;
+    }
+
+    return (n & 1) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+// Shared RSSI fields for the beacon JSON payloads
+#define BEACON_RSSI_JSON                \
+    "\"rssi\":%d,"                      \
+    "\"rssi_count\":%d,"                \
+    "\"rssi_min\":%d,"                  \
+    "\"rssi_max\":%d,"                  \
+    "\"rssi_mean\":%d,"                 \
+    "\"rssi_median\":%d,"
+#define BEACON_RSSI_JSON_ARGS(beacon)   \
+    (beacon)->rssi,                     \
+    (beacon)->rssi_count,               \
+    (beacon)->rssi_min,                 \
+    (beacon)->rssi_max,                 \
+    beacon_rssi_mean(beacon),           \
+    beacon_rssi_median(beacon)
+
+// CBOR carries the same fields as the JSON payloads, minus the hostname already in the topic
+static void cbor_beacon_fields(bbl_cbor_t *cbor, const beacon_t *beacon, const char *beacon_type, size_t extra_pairs)
+{
+    bbl_cbor_map(cbor, 8 + (beacon_type != NULL) + extra_pairs);
+
+    if (beacon_type != NULL) {
+        bbl_cbor_text(cbor, "beacon_type");
+        bbl_cbor_text(cbor, beacon_type);
+    }
+
+    bbl_cbor_text(cbor, "mac");
+    bbl_cbor_bytes(cbor, beacon->mac, sizeof(beacon->mac));
+    bbl_cbor_text(cbor, "rssi");
+    bbl_cbor_int(cbor, beacon->rssi);
+    bbl_cbor_text(cbor, "rssi_count");
+    bbl_cbor_uint(cbor, beacon->rssi_count);
+    bbl_cbor_text(cbor, "rssi_min");
+    bbl_cbor_int(cbor, beacon->rssi_min);
+    bbl_cbor_text(cbor, "rssi_max");
+    bbl_cbor_int(cbor, beacon->rssi_max);
+    bbl_cbor_text(cbor, "rssi_mean");
+    bbl_cbor_int(cbor, beacon_rssi_mean(beacon));
+    bbl_cbor_text(cbor, "rssi_median");
+    bbl_cbor_int(cbor, beacon_rssi_median(beacon));
+    bbl_cbor_text(cbor, "data");
+    bbl_cbor_bytes(cbor, beacon->adv_data, beacon->adv_data_len);
+}
+
 static bool ble_publish(const char * const topic, const char * const payload, size_t payload_length)
 {
-    if (!bbl_mqtt_connect()) {
-        return false;
+    if (bbl_mqtt_enqueue(topic, payload, payload_length)) {
+        return true;
     }
 
-    if (bbl_mqtt_publish(topic, payload, payload_length)) {
+    // The queue only fills up when the broker has been gone a while; keep the report for later
+    if (bbl_spool_append(topic, payload, payload_length)) {
         return true;
-    } else {
-        bbl_mqtt_disconnect();
-        INC_STAT(publishing_errors);
+    }
+
+    INC_STAT(publishing_errors);
+    return false;
+}
+
+static void ble_batch_flush()
+{
+    if (ble_batch_used == 0) {
+        return;
+    }
+
+    ble_batch_buf[ble_batch_used++] = (ble_encoding == EncodingCBOR) ? BBL_CBOR_BREAK : ']';
+
+    if (ble_publish(ble_batch_topic, ble_batch_buf, ble_batch_used)) {
+        INC_STAT(batches_published);
+    }
+
+    ble_batch_used = 0;
+    ble_batch_reports = 0;
+}
+
+// A batch that can't be published is spooled with a stamp added to each of its reports, so it
+// has to leave the spool room for those as well as fit the configured maximum
+static size_t ble_batch_limit(size_t reports)
+{
+    size_t limit = (ble_batch_max < sizeof(ble_batch_buf)) ? ble_batch_max : sizeof(ble_batch_buf);
+    size_t spool_max = bbl_spool_payload_max(ble_batch_topic_len, reports);
+
+    return (spool_max < limit) ? spool_max : limit;
+}
+
+static bool ble_batch_append(const char *payload, size_t payload_length)
+{
+    bool cbor = ble_encoding == EncodingCBOR;
+
+    // Room for the separator and the closing bracket
+    if (ble_batch_used > 0 && ble_batch_used + payload_length + 2 > ble_batch_limit(ble_batch_reports + 1)) {
+        ble_batch_flush();
+    }
+
+    if (payload_length + 2 > ble_batch_limit(1)) {
         return false;
     }
+
+    // CBOR batches are indefinite-length arrays, which need no separators
+    if (ble_batch_used == 0) {
+        ble_batch_buf[ble_batch_used++] = cbor ? BBL_CBOR_INDEFINITE_ARRAY : '[';
+    } else if (!cbor) {
+        ble_batch_buf[ble_batch_used++] = ',';
+    }
+    memcpy(ble_batch_buf + ble_batch_used, payload, payload_length);
+    ble_batch_used += payload_length;
+    ++ble_batch_reports;
+
+    return true;
+}
+
+// Publishes one beacon message, or queues it for the window's batch when batching is enabled
+static bool ble_emit(const char *topic, const char *payload, size_t payload_length)
+{
+    if (ble_batch_max > 0) {
+        return ble_batch_append(payload, payload_length);
+    }
+
+    return ble_publish(topic, payload, payload_length);
 }
 
-static void publish_raw(beacon_t *beacon)
+static bool publish_raw(beacon_t *beacon)
 {
-    char mqtt_buf[640];
+    char mqtt_buf[1024];
 
     size_t topic_length = bbl_snprintf(mqtt_buf, sizeof(mqtt_buf), "happy-bubbles/ble/%s/raw/%.*hs",
         bbl_config_get_string(ConfigKeyHostname), sizeof(beacon->mac), beacon->mac
     );
 
     char *payload = mqtt_buf + topic_length + 1;
-    size_t payload_length = bbl_snprintf(payload, sizeof(mqtt_buf) - (payload - mqtt_buf),
-        "{"
-            "\"hostname\":\"%js\","
-            "\"mac\":\"%.*hs\","
-            "\"rssi\":%d,"
-            "\"data\":\"%.*hs\""
-        "}",
-        bbl_config_get_string(ConfigKeyHostname),
-        sizeof(beacon->mac), beacon->mac,
-        beacon->rssi,
-        beacon->adv_data_len, beacon->adv_data
-    );
+    size_t payload_size = sizeof(mqtt_buf) - (payload - mqtt_buf);
+    size_t payload_length;
+
+    if (ble_encoding == EncodingCBOR) {
+        bbl_cbor_t cbor;
+
+        bbl_cbor_init(&cbor, payload, payload_size);
+        cbor_beacon_fields(&cbor, beacon, NULL, 0);
+        if (cbor.overflow) {
+            // A truncated map wouldn't decode
+            INC_STAT(publishing_errors);
+            return false;
+        }
+        payload_length = cbor.used;
+    } else {
+        payload_length = bbl_snprintf(payload, payload_size,
+            "{"
+                "\"hostname\":\"%js\","
+                "\"mac\":\"%.*hs\","
+                BEACON_RSSI_JSON
+                "\"data\":\"%.*hs\""
+            "}",
+            bbl_config_get_string(ConfigKeyHostname),
+            sizeof(beacon->mac), beacon->mac,
+            BEACON_RSSI_JSON_ARGS(beacon),
+            beacon->adv_data_len, beacon->adv_data
+        );
+    }
 
-    if (ble_publish(mqtt_buf, payload, payload_length)) {
+    if (ble_emit(mqtt_buf, payload, payload_length)) {
         INC_STAT(raw_published);
+        return true;
     }
+
+    return false;
 }
 
-static void publish_ibeacon(beacon_t *beacon, const esp_ble_ibeacon_t *ib_data)
+static void publish_ibeacon(beacon_t *beacon, const beacon_identity_t *identity)
 {
-    char mqtt_buf[640];
+    char mqtt_buf[768];
 
-    size_t topic_length = bbl_snprintf(mqtt_buf, sizeof(mqtt_buf), "happy-bubbles/ble/%s/ibeacon/%.*hs",
-        bbl_config_get_string(ConfigKeyHostname),
-        sizeof(ib_data->ibeacon_vendor.proximity_uuid), ib_data->ibeacon_vendor.proximity_uuid
+    size_t topic_length = bbl_snprintf(mqtt_buf, sizeof(mqtt_buf), "happy-bubbles/ble/%s/ibeacon/%s",
+        bbl_config_get_string(ConfigKeyHostname), identity->id
     );
 
+    // Happy Bubbles Presence Server doesn't care about Altbeacons, so lie and say they're iBeacons
     char *payload = mqtt_buf + topic_length + 1;
-    size_t payload_length = bbl_snprintf(payload, sizeof(mqtt_buf) - (payload - mqtt_buf),
-        "{"
-            "\"hostname\":\"%js\","
-            "\"beacon_type\":\"ibeacon\","
-            "\"mac\":\"%.*hs\","
-            "\"rssi\":%d,"
-            "\"data\":\"%.*hs\","
-            "\"uuid\":\"%.*hs\","
-            "\"major\":\"%04x\","
-            "\"minor\":\"%04x\","
-            "\"tx_power\":\"%02x\""
-        "}",
-        bbl_config_get_string(ConfigKeyHostname),
-        sizeof(beacon->mac), beacon->mac,
-        beacon->rssi,
-        beacon->adv_data_len, beacon->adv_data,
-        sizeof(ib_data->ibeacon_vendor.proximity_uuid), ib_data->ibeacon_vendor.proximity_uuid,
-        ib_data->ibeacon_vendor.major,
-        ib_data->ibeacon_vendor.minor,
-        (uint8_t)ib_data->ibeacon_vendor.measured_power
-    );
+    size_t payload_size = sizeof(mqtt_buf) - (payload - mqtt_buf);
+    size_t payload_length;
+
+    if (ble_encoding == EncodingCBOR) {
+        bbl_cbor_t cbor;
+
+        bbl_cbor_init(&cbor, payload, payload_size);
+        cbor_beacon_fields(&cbor, beacon, "ibeacon", 4);
+        bbl_cbor_text(&cbor, "uuid");
+        bbl_cbor_bytes(&cbor, beacon->adv_data + identity->id_offset, BEACON_UUID_LEN);
+        bbl_cbor_text(&cbor, "major");
+        bbl_cbor_uint(&cbor, identity->major);
+        bbl_cbor_text(&cbor, "minor");
+        bbl_cbor_uint(&cbor, identity->minor);
+        bbl_cbor_text(&cbor, "tx_power");
+        bbl_cbor_int(&cbor, identity->tx_power);
+        if (cbor.overflow) {
+            INC_STAT(publishing_errors);
+            return;
+        }
+        payload_length = cbor.used;
+    } else {
+        payload_length = bbl_snprintf(payload, payload_size,
+            "{"
+                "\"hostname\":\"%js\","
+                "\"beacon_type\":\"ibeacon\","
+                "\"mac\":\"%.*hs\","
+                BEACON_RSSI_JSON
+                "\"data\":\"%.*hs\","
+                "\"uuid\":\"%s\","
+                "\"major\":\"%04x\","
+                "\"minor\":\"%04x\","
+                "\"tx_power\":\"%02x\""
+            "}",
+            bbl_config_get_string(ConfigKeyHostname),
+            sizeof(beacon->mac), beacon->mac,
+            BEACON_RSSI_JSON_ARGS(beacon),
+            beacon->adv_data_len, beacon->adv_data,
+            identity->id,
+            identity->major,
+            identity->minor,
+            (uint8_t)identity->tx_power
+        );
+    }
 
-    if (ble_publish(mqtt_buf, payload, payload_length)) {
+    if (ble_emit(mqtt_buf, payload, payload_length)) {
         INC_STAT(ibeacon_published);
     }
 }
 
-static void publish_eddystone(beacon_t *beacon, const esp_eddystone_result_t *es_data)
+static void publish_eddystone(beacon_t *beacon, const beacon_identity_t *identity)
 {
-    if (es_data->common.frame_type != EDDYSTONE_FRAME_TYPE_UID) {
-        return;
-    }
+    char mqtt_buf[768];
 
-    char mqtt_buf[640];
-
-    size_t topic_length = bbl_snprintf(mqtt_buf, sizeof(mqtt_buf), "happy-bubbles/ble/%s/eddystone/%.*hs",
-        bbl_config_get_string(ConfigKeyHostname),
-        sizeof(es_data->inform.uid.namespace_id), es_data->inform.uid.namespace_id
+    size_t topic_length = bbl_snprintf(mqtt_buf, sizeof(mqtt_buf), "happy-bubbles/ble/%s/eddystone/%s",
+        bbl_config_get_string(ConfigKeyHostname), identity->id
     );
 
     char *payload = mqtt_buf + topic_length + 1;
-    size_t payload_length = bbl_snprintf(payload, sizeof(mqtt_buf) - (payload - mqtt_buf),
-        "{"
-            "\"hostname\":\"%js\","
-            "\"beacon_type\":\"eddystone\","
-            "\"mac\":\"%.*hs\","
-            "\"rssi\":%d,"
-            "\"data\":\"%.*hs\","
-            "\"namespace\":\"%.*hs\","
-            "\"instance_id\":\"%.*hs\","
-            "\"tx_power\":\"%02x\""
-        "}",
-        bbl_config_get_string(ConfigKeyHostname),
-        sizeof(beacon->mac), beacon->mac,
-        beacon->rssi,
-        beacon->adv_data_len, beacon->adv_data,
-        sizeof(es_data->inform.uid.namespace_id), es_data->inform.uid.namespace_id,
-        sizeof(es_data->inform.uid.instance_id), es_data->inform.uid.instance_id,
-        (uint8_t)es_data->inform.uid.ranging_data
-    );
+    size_t payload_size = sizeof(mqtt_buf) - (payload - mqtt_buf);
+    size_t payload_length;
+
+    if (ble_encoding == EncodingCBOR) {
+        bbl_cbor_t cbor;
+
+        bbl_cbor_init(&cbor, payload, payload_size);
+        cbor_beacon_fields(&cbor, beacon, "eddystone", 3);
+        bbl_cbor_text(&cbor, "namespace");
+        bbl_cbor_bytes(&cbor, beacon->adv_data + identity->id_offset, EDDYSTONE_UID_NAMESPACE_LEN);
+        bbl_cbor_text(&cbor, "instance_id");
+        bbl_cbor_bytes(&cbor, beacon->adv_data + identity->id_offset + EDDYSTONE_UID_NAMESPACE_LEN, EDDYSTONE_UID_INSTANCE_LEN);
+        bbl_cbor_text(&cbor, "tx_power");
+        bbl_cbor_int(&cbor, identity->tx_power);
+        if (cbor.overflow) {
+            INC_STAT(publishing_errors);
+            return;
+        }
+        payload_length = cbor.used;
+    } else {
+        payload_length = bbl_snprintf(payload, payload_size,
+            "{"
+                "\"hostname\":\"%js\","
+                "\"beacon_type\":\"eddystone\","
+                "\"mac\":\"%.*hs\","
+                BEACON_RSSI_JSON
+                "\"data\":\"%.*hs\","
+                "\"namespace\":\"%s\","
+                "\"instance_id\":\"%s\","
+                "\"tx_power\":\"%02x\""
+            "}",
+            bbl_config_get_string(ConfigKeyHostname),
+            sizeof(beacon->mac), beacon->mac,
+            BEACON_RSSI_JSON_ARGS(beacon),
+            beacon->adv_data_len, beacon->adv_data,
+            identity->id,
+            identity->instance,
+            (uint8_t)identity->tx_power
+        );
+    }
 
-    if (ble_publish(mqtt_buf, payload, payload_length)) {
+    if (ble_emit(mqtt_buf, payload, payload_length)) {
         INC_STAT(eddystone_published);
     }
 }
 
-static void publish_altbeacon(beacon_t *beacon, const esp_ble_altbeacon_t *ab_data)
+static beacon_history_t *find_beacon_history(const beacon_t *beacon)
 {
-    char mqtt_buf[640];
+    uint16_t idx = bbl_mactable_find(&beacon_history_index, beacon->mac);
 
-    size_t topic_length = bbl_snprintf(mqtt_buf, sizeof(mqtt_buf), "happy-bubbles/ble/%s/ibeacon/%.*hs",
-        bbl_config_get_string(ConfigKeyHostname),
-        sizeof(ab_data->beacon_id), ab_data->beacon_id
-    );
+    if (idx != BBL_MACTABLE_EMPTY) {
+        return &beacon_history[idx];
+    }
 
-    // Happy Bubbles Presence Server doesn't care about Altbeacons, so lie and say we're an iBeacon
-    char *payload = mqtt_buf + topic_length + 1;
-    size_t payload_length = bbl_snprintf(payload, sizeof(mqtt_buf) - (payload - mqtt_buf),
-        "{"
-            "\"hostname\":\"%js\","
-            "\"beacon_type\":\"ibeacon\","
-            "\"mac\":\"%.*hs\","
-            "\"rssi\":%d,"
-            "\"data\":\"%.*hs\","
-            "\"uuid\":\"%.*hs\","
-            "\"major\":\"%04x\","
-            "\"minor\":\"%04x\","
-            "\"tx_power\":\"%02x\""
-        "}",
-        bbl_config_get_string(ConfigKeyHostname),
-        sizeof(beacon->mac), beacon->mac,
-        beacon->rssi,
-        beacon->adv_data_len, beacon->adv_data,
-        sizeof(ab_data->beacon_id), ab_data->beacon_id,
-        ab_data->major,
-        ab_data->minor,
-        (uint8_t)ab_data->rssi
-    );
+    if (beacon_history_count < BBL_BEACON_HISTORY_SIZE) {
+        idx = beacon_history_count++;
+    } else {
+        // Forget whichever beacon we published longest ago
+        idx = 0;
+        for (int i = 1; i < beacon_history_count; ++i) {
+            if ((int32_t)(beacon_history[i].published - beacon_history[idx].published) < 0) {
+                idx = i;
+            }
+        }
+        bbl_mactable_remove(&beacon_history_index, beacon_history[idx].mac);
+    }
 
-    if (ble_publish(mqtt_buf, payload, payload_length)) {
-        INC_STAT(ibeacon_published);
+    beacon_history_t *result = &beacon_history[idx];
+    memcpy(result->mac, beacon->mac, sizeof(result->mac));
+    // Backdate the last publish so a newly tracked beacon is always reported
+    result->published = bbl_millis() - INT32_MAX;
+    result->adv_hash = 0;
+    result->rssi = 0;
+    result->identity.decoded = false;
+    bbl_mactable_insert(&beacon_history_index, result->mac, idx);
+    return result;
+}
+
+static bool beacon_changed(const beacon_history_t *history, uint32_t adv_hash, int rssi)
+{
+    int rssi_delta = bbl_config_get_int(ConfigKeyRSSIDelta);
+    uint32_t heartbeat = bbl_config_get_int(ConfigKeyHeartbeat);
+
+    // Suppression is off without an RSSI delta
+    if (rssi_delta <= 0) {
+        return true;
+    }
+
+    // Without a heartbeat, an unchanged beacon isn't published again
+    return history->adv_hash != adv_hash ||
+        abs(rssi - history->rssi) >= rssi_delta ||
+        (heartbeat != 0 && bbl_millis() - history->published >= heartbeat * 1000);
+}
+
+static const beacon_identity_t *beacon_identity(beacon_history_t *history, const beacon_t *beacon, uint32_t adv_hash)
+{
+    beacon_identity_t *identity = &history->identity;
+    bbl_adv_t adv;
+
+    if (identity->decoded && identity->adv_hash == adv_hash) {
+        INC_STAT(identities_reused);
+        return identity;
+    }
+
+    identity->adv_hash = adv_hash;
+    identity->decoded = true;
+    identity->type = bbl_adv_decode(beacon->adv_data, beacon->adv_data_len, &adv);
+    identity->id_offset = adv.offset + BEACON_ID_AD_OFFSET;
+    identity->instance[0] = '\0';
+
+    switch (identity->type) {
+    case AdvTypeIBeacon:
+        identity->major = adv.ibeacon.ibeacon_vendor.major;
+        identity->minor = adv.ibeacon.ibeacon_vendor.minor;
+        identity->tx_power = adv.ibeacon.ibeacon_vendor.measured_power;
+        bbl_snprintf(identity->id, sizeof(identity->id), "%.*hs",
+            sizeof(adv.ibeacon.ibeacon_vendor.proximity_uuid), adv.ibeacon.ibeacon_vendor.proximity_uuid
+        );
+        break;
+
+    case AdvTypeAltBeacon:
+        identity->major = adv.altbeacon.major;
+        identity->minor = adv.altbeacon.minor;
+        identity->tx_power = adv.altbeacon.rssi;
+        bbl_snprintf(identity->id, sizeof(identity->id), "%.*hs",
+            sizeof(adv.altbeacon.beacon_id), adv.altbeacon.beacon_id
+        );
+        break;
+
+    case AdvTypeEddystoneUID:
+        identity->tx_power = adv.eddystone.inform.uid.ranging_data;
+        bbl_snprintf(identity->id, sizeof(identity->id), "%.*hs",
+            sizeof(adv.eddystone.inform.uid.namespace_id), adv.eddystone.inform.uid.namespace_id
+        );
+        bbl_snprintf(identity->instance, sizeof(identity->instance), "%.*hs",
+            sizeof(adv.eddystone.inform.uid.instance_id), adv.eddystone.inform.uid.instance_id
+        );
+        break;
+
+    default:
+        identity->id[0] = '\0';
+        break;
     }
+
+    return identity;
 }
 
 static void publish_ble_advertisement(beacon_t *beacon)
 {
-    esp_ble_ibeacon_t ib_data;
-    esp_eddystone_result_t es_data;
-    esp_ble_altbeacon_t ab_data;
+    beacon_history_t *history = find_beacon_history(beacon);
+    uint32_t adv_hash = bbl_fnv1a(beacon->adv_data, beacon->adv_data_len);
+    int rssi = beacon_rssi_median(beacon);
+
+    if (!beacon_changed(history, adv_hash, rssi)) {
+        INC_STAT(beacons_suppressed);
+        return;
+    }
 
-    publish_raw(beacon);
-    if (esp_ibeacon_decode(beacon->adv_data, beacon->adv_data_len, &ib_data) == ESP_OK) {
-        publish_ibeacon(beacon, &ib_data);
-    } else if (esp_eddystone_decode(beacon->adv_data, beacon->adv_data_len, &es_data) == ESP_OK) {
-        publish_eddystone(beacon, &es_data);
-    } else if (esp_altbeacon_decode(beacon->adv_data, beacon->adv_data_len, &ab_data) == ESP_OK) {
-        publish_altbeacon(beacon, &ab_data);
+    if (publish_raw(beacon)) {
+        history->adv_hash = adv_hash;
+        history->rssi = rssi;
+        history->published = bbl_millis();
+    }
+
+    const beacon_identity_t *identity = beacon_identity(history, beacon, adv_hash);
+
+    switch (identity->type) {
+    case AdvTypeIBeacon:
+    case AdvTypeAltBeacon:
+        publish_ibeacon(beacon, identity);
+        break;
+
+    case AdvTypeEddystoneUID:
+        publish_eddystone(beacon, identity);
+        break;
+
+    default:
+        break;
     }
 }
 
 #if BBL_PUBLISH_STATS
+// The stats payload with every counter at its maximum is 1,296 bytes, against 757 when they are
+// all zero.  bench/check_stats.py checks this, and that every conversion has its argument.
+#define STATS_TOPIC_MAX 128
+#define STATS_PAYLOAD_MAX 1312
+
 static void publish_stats(uint32_t elapsed)
 {
-    char mqtt_buf[640];
+    char mqtt_buf[STATS_TOPIC_MAX + STATS_PAYLOAD_MAX];
 
     uptime_millis += elapsed;
+
+    uint32_t scan_total = scan_millis + (scan_active ? bbl_millis() - scan_started_millis : 0);
+    uint32_t scanned = scan_total - stats_scan_millis;
+    unsigned int scan_duty = elapsed ? (unsigned int)((uint64_t)scanned * 1000 / elapsed) : 0;
+    stats_scan_millis += scanned;
+
+    bbl_mqtt_stats_t mqtt_stats;
+    bbl_mqtt_stats(&mqtt_stats);
+    const bbl_spool_stats_t *spool_stats = bbl_spool_stats();
+    unsigned int records_per_publish = mqtt_stats.publishes ? (unsigned int)((uint64_t)mqtt_stats.writes * 100 / mqtt_stats.publishes) : 0;
+
+    // Average PUBACK latency over this stats interval only
+    static uint32_t stats_acked;
+    static uint64_t stats_rtt_total_ms;
+    uint32_t acked = mqtt_stats.acked - stats_acked;
+    unsigned int rtt_avg = acked ? (unsigned int)((mqtt_stats.rtt_total_ms - stats_rtt_total_ms) / acked) : 0;
+    stats_acked += acked;
+    stats_rtt_total_ms = mqtt_stats.rtt_total_ms;
+
+    // Bytes topic aliases saved over this stats interval
+    static int64_t stats_alias_saved;
+    int alias_saved = (int)(mqtt_stats.alias_bytes_saved - stats_alias_saved);
+    stats_alias_saved = mqtt_stats.alias_bytes_saved;
+
     unsigned int uptime_days    = (unsigned int)(uptime_millis / (24 * 60 * 60 * 1000));
     unsigned int uptime_hours   = (unsigned int)(uptime_millis / (60 * 60 * 1000) % 24);
     unsigned int uptime_minutes = (unsigned int)(uptime_millis / (60 * 1000) % 60);
     unsigned int uptime_seconds = (unsigned int)(uptime_millis / 1000 % 60);
     unsigned int uptime_ms      = (unsigned int)(uptime_millis % 1000);
 
-    size_t topic_length = bbl_snprintf(mqtt_buf, sizeof(mqtt_buf), "happy-bubbles/stats/%s",
+    size_t topic_length = bbl_snprintf(mqtt_buf, STATS_TOPIC_MAX, "happy-bubbles/stats/%s",
         bbl_config_get_string(ConfigKeyHostname));
 
     char *payload = mqtt_buf + topic_length + 1;
-    size_t payload_length = bbl_snprintf(payload, sizeof(mqtt_buf) - (payload - mqtt_buf),
+    size_t payload_size = sizeof(mqtt_buf) - (payload - mqtt_buf);
+    size_t payload_length = bbl_snprintf(payload, payload_size,
         "{"
             "\"boot_count\":%,u,"
             "\"uptime\":\"%ud,%02u:%02u:%02u.%03u\","
@@ -269,7 +846,43 @@ static void publish_stats(uint32_t elapsed)
             "\"pub_raw\":\"%,u\","
             "\"pub_ibeacon\":\"%,u\","
             "\"pub_eddystone\":\"%,u\","
-            "\"pub_err\":\"%,u\""
+            "\"pub_err\":\"%,u\","
+            "\"pub_suppressed\":\"%,u\","
+            "\"pub_batch\":\"%,u\","
+            "\"id_reused\":\"%,u\","
+            "\"filtered\":\"%,u\","
+            "\"evicted\":\"%,u\","
+            "\"dropped\":\"%,u\","
+            "\"ring_drop\":\"%,u\","
+            "\"ring_ovf\":\"%,u\","
+            "\"ring_hwm\":%u,"
+            "\"rec_per_pub\":\"%u.%02u\","
+            "\"wire_bytes\":\"%,llu\","
+            "\"mqtt_drop\":\"%,u\","
+            "\"mqtt_conn\":\"%,u\","
+            "\"mqtt_conn_fail\":\"%,u\","
+            "\"mqtt_disconn\":\"%,u\","
+            "\"mqtt_queue_free\":%u,"
+            "\"mqtt_ping_timeouts\":\"%,u\","
+            "\"mqtt_ping_ms\":%u,"
+            "\"mqtt_acked\":\"%,u\","
+            "\"mqtt_retx\":\"%,u\","
+            "\"mqtt_inflight\":%u,"
+            "\"mqtt_rtt_avg\":%u,"
+            "\"mqtt_rtt_max\":%u,"
+            "\"mqtt_alias_saved\":%d,"
+            "\"mqtt_rx\":\"%,u\","
+            "\"mqtt_rx_drop\":\"%,u\","
+            "\"spool_depth\":%u,"
+            "\"spool_lag_ms\":%u,"
+            "\"spooled\":\"%,u\","
+            "\"spool_replayed\":\"%,u\","
+            "\"spool_drop\":\"%,u\","
+            "\"spool_oversized\":\"%,u\","
+            "\"tls_handshakes\":\"%,u\","
+            "\"tls_resumed\":\"%,u\","
+            "\"tls_handshake_ms\":%u,"
+            "\"scan_duty\":\"%u.%u%%\""
         "}",
         boot_count,
         uptime_days, uptime_hours, uptime_minutes, uptime_seconds, uptime_ms,
@@ -277,12 +890,253 @@ static void publish_stats(uint32_t elapsed)
         raw_published,
         ibeacon_published,
         eddystone_published,
-        publishing_errors
+        publishing_errors,
+        beacons_suppressed,
+        batches_published,
+        identities_reused,
+        advertisements_filtered,
+        beacons_evicted,
+        beacons_dropped,
+        ble_adv_ring.dropped,
+        ble_adv_ring.overflows,
+        ble_adv_ring.high_water,
+        records_per_publish / 100, records_per_publish % 100,
+        mqtt_stats.bytes_written,
+        mqtt_stats.dropped,
+        mqtt_stats.connects,
+        mqtt_stats.connect_failures,
+        mqtt_stats.disconnects,
+        mqtt_stats.queue_free,
+        mqtt_stats.ping_timeouts,
+        mqtt_stats.ping_rtt_ms,
+        mqtt_stats.acked,
+        mqtt_stats.retransmits,
+        mqtt_stats.inflight,
+        rtt_avg,
+        mqtt_stats.rtt_max_ms,
+        alias_saved,
+        mqtt_stats.received,
+        mqtt_stats.rx_dropped,
+        spool_stats->depth,
+        spool_stats->lag_ms,
+        spool_stats->spooled,
+        spool_stats->replayed,
+        spool_stats->dropped,
+        spool_stats->oversized,
+        mqtt_stats.tls_handshakes,
+        mqtt_stats.tls_resumed,
+        mqtt_stats.tls_handshake_ms,
+        scan_duty / 10, scan_duty % 10
     );
 
+    // bbl_snprintf stops short when it runs out of room, which would cut the JSON off mid-value
+    if (payload_length + 1 >= payload_size) {
+        BBL_LOG("Stats didn't fit in %u bytes", (unsigned int)payload_size);
+        INC_STAT(publishing_errors);
+        return;
+    }
+
     ble_publish(mqtt_buf, payload, payload_length);
 }
+
+void bbl_ble_metrics(bbl_metrics_t *metrics)
+{
+    bbl_metrics_counter(metrics, "bbl_advertisements_seen_total", adversitements_received);
+    bbl_metrics_counter(metrics, "bbl_advertisements_filtered_total", advertisements_filtered);
+
+    bbl_metrics_family(metrics, "bbl_published_total", "counter");
+    bbl_metrics_sample(metrics, "bbl_published_total", "type=\"raw\"", raw_published);
+    bbl_metrics_sample(metrics, "bbl_published_total", "type=\"ibeacon\"", ibeacon_published);
+    bbl_metrics_sample(metrics, "bbl_published_total", "type=\"eddystone\"", eddystone_published);
+    bbl_metrics_sample(metrics, "bbl_published_total", "type=\"batch\"", batches_published);
+
+    bbl_metrics_counter(metrics, "bbl_publish_errors_total", publishing_errors);
+    bbl_metrics_counter(metrics, "bbl_beacons_suppressed_total", beacons_suppressed);
+    bbl_metrics_counter(metrics, "bbl_beacons_evicted_total", beacons_evicted);
+    bbl_metrics_counter(metrics, "bbl_beacons_dropped_total", beacons_dropped);
+    bbl_metrics_counter(metrics, "bbl_identities_reused_total", identities_reused);
+
+    // GAP callback to publisher hand-off
+    bbl_metrics_gauge(metrics, "bbl_adv_ring_depth", bbl_ring_count(&ble_adv_ring));
+    bbl_metrics_gauge(metrics, "bbl_adv_ring_high_water", ble_adv_ring.high_water);
+    bbl_metrics_counter(metrics, "bbl_adv_ring_dropped_total", ble_adv_ring.dropped);
+}
+#else
+void bbl_ble_metrics(bbl_metrics_t *metrics)
+{
+    (void)metrics;
+}
+#endif
+
+static void ble_ingest_advertisements()
+{
+    const ble_adv_record_t *record;
+
+    while ((record = bbl_ring_peek(&ble_adv_ring)) != NULL) {
+        beacon_t *beacon = find_beacon(&beacon_caches[beacon_generation], record);
+
+        if (beacon != NULL) {
+            beacon_add_rssi(beacon, record->rssi);
+            beacon->last_seen = bbl_millis();
+            // Keeps the previous advertisement if a longer one no longer fits
+            if (beacon_reserve_adv(&beacon_caches[beacon_generation], beacon, record->adv_data_len)) {
+                memcpy(beacon->adv_data, record->adv_data, record->adv_data_len);
+                beacon->adv_data_len = record->adv_data_len;
+            }
+            beacon_cache_touch(&beacon_caches[beacon_generation], beacon);
+        }
+
+        bbl_ring_release(&ble_adv_ring);
+    }
+}
+
+static void ble_flush_generation(beacon_cache_t *cache)
+{
+    ble_encoding = bbl_config_get_int(ConfigKeyEncoding);
+    ble_batch_max = bbl_config_get_int(ConfigKeyBatchMax);
+    ble_batch_topic_len = bbl_snprintf(ble_batch_topic, sizeof(ble_batch_topic), "happy-bubbles/ble/%s/batch",
+        bbl_config_get_string(ConfigKeyHostname));
+
+    for (int i = 0; i < cache->count; ++i) {
+        publish_ble_advertisement(&cache->beacons[i]);
+        // Keep filling the fresh generation so the ring doesn't back up during a slow flush
+        ble_ingest_advertisements();
+        esp_task_wdt_feed();
+    }
+
+    ble_batch_flush();
+    bbl_mqtt_flush();
+    beacon_cache_reset(cache);
+}
+
+static void ble_apply_config();
+
+static void ble_publish_task_thread()
+{
+    for (;;) {
+        // The GAP callback notifies us each time a scan window completes
+        bool window_complete = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BLE_RING_POLL_MS)) > 0;
+
+        if (ble_reconfigure_pending) {
+            // Setting the new parameters restarts the scan
+            ble_reconfigure_pending = false;
+            ble_apply_config();
+            esp_ble_gap_set_scan_params(&ble_scan_params);
+        }
+
+        ble_ingest_advertisements();
+        bbl_spool_service();
+
+        if (window_complete) {
+            // A continuous scan has no windows of its own to apply a failed reconfigure at
+            if (ble_reconfigure_requested && ble_report_timer != NULL) {
+                esp_ble_gap_stop_scanning();
+            }
+
+            beacon_cache_t *completed = &beacon_caches[beacon_generation];
+
+            beacon_generation ^= 1;
+            ble_flush_generation(completed);
+
+#if BBL_PUBLISH_STATS
+            uint32_t now = bbl_millis();
+            if (now - stats_millis >= STATS_INTERVAL_SEC * 1000) {
+                publish_stats(now - stats_millis);
+                bbl_mqtt_flush();
+                stats_millis = now;
+            }
 #endif
+        }
+
+        esp_task_wdt_feed();
+    }
+
+    vTaskDelete(NULL);
+}
+
+static void ble_report_timer_cb(void *arg)
+{
+    (void)arg;
+
+    xTaskNotifyGive(ble_publish_task);
+}
+
+static uint16_t ble_scan_units(int ms)
+{
+    int units = ms * 8 / 5;
+
+    if (units < BLE_SCAN_UNITS_MIN) {
+        return BLE_SCAN_UNITS_MIN;
+    } else if (units > BLE_SCAN_UNITS_MAX) {
+        return BLE_SCAN_UNITS_MAX;
+    }
+
+    return units;
+}
+
+// Reads everything the scan depends on from the config.  Only called while not scanning.
+static void ble_apply_config()
+{
+    ble_scan_params.scan_interval = ble_scan_units(bbl_config_get_int(ConfigKeyScanInterval));
+    ble_scan_params.scan_window = ble_scan_units(bbl_config_get_int(ConfigKeyScanWindow));
+    if (ble_scan_params.scan_window > ble_scan_params.scan_interval) {
+        ble_scan_params.scan_window = ble_scan_params.scan_interval;
+    }
+
+    ble_min_rssi = bbl_config_get_int(ConfigKeyMinRSSI);
+
+    if (ble_report_timer != NULL) {
+        esp_timer_stop(ble_report_timer);
+        esp_timer_delete(ble_report_timer);
+        ble_report_timer = NULL;
+    }
+
+    ble_scan_duration = BLE_SCAN_WINDOW_SEC;
+    if (bbl_config_get_int(ConfigKeyScanMode) == ScanModeContinuous) {
+        // Scan forever and let a timer set the reporting cadence instead of scan completion
+        const esp_timer_create_args_t timer_args = {
+            .callback = ble_report_timer_cb,
+            .name = "ble_report",
+        };
+        int interval = bbl_config_get_int(ConfigKeyReportInterval);
+
+        if (interval < BLE_MIN_REPORT_INTERVAL_MS) {
+            interval = BLE_MIN_REPORT_INTERVAL_MS;
+        }
+
+        if (esp_timer_create(&timer_args, &ble_report_timer) == ESP_OK) {
+            esp_timer_start_periodic(ble_report_timer, interval * 1000ULL);
+            ble_scan_duration = 0;
+        } else {
+            ble_report_timer = NULL;
+        }
+    }
+    BBL_LOG("Scanning in %s mode, %u/%u scan units", bbl_config_scan_mode_string(ble_scan_duration ? ScanModeWindowed : ScanModeContinuous),
+        ble_scan_params.scan_window, ble_scan_params.scan_interval);
+}
+
+void bbl_ble_reconfigure()
+{
+    // The publisher applies the config once the GAP callback says the scan has stopped.  If it
+    // wasn't running, the scan is between windows and the next one picks up the request.
+    ble_reconfigure_requested = true;
+    esp_ble_gap_stop_scanning();
+}
+
+// Hands a requested reconfigure to the publisher, whose esp_ble_gap_set_scan_params() restarts
+// the scan.  Only called while not scanning.
+static void ble_reconfigure_stopped()
+{
+#if BBL_PUBLISH_STATS
+    if (scan_active) {
+        scan_active = false;
+        scan_millis += bbl_millis() - scan_started_millis;
+    }
+#endif
+    ble_reconfigure_requested = false;
+    // Timers are no business of the BTC task, the publisher picks this up within a poll
+    ble_reconfigure_pending = true;
+}
 
 static void ble_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
@@ -290,43 +1144,70 @@ static void ble_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
 
     switch (event) {
     case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
-        esp_ble_gap_start_scanning(1);
+        esp_ble_gap_start_scanning(ble_scan_duration);
+        break;
+
+    case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+        // Stopped by bbl_ble_reconfigure()
+        if (param->scan_stop_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+            BBL_LOG("Couldn't stop scanning to reconfigure, status %d; retrying at the next window", param->scan_stop_cmpl.status);
+            break;
+        }
+        if (ble_reconfigure_requested) {
+            ble_reconfigure_stopped();
+        }
         break;
 
     case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
         if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
-            esp_ble_gap_start_scanning(1);
+            esp_ble_gap_start_scanning(ble_scan_duration);
+            break;
         }
+#if BBL_PUBLISH_STATS
+        scan_started_millis = bbl_millis();
+        scan_active = true;
+#endif
         break;
 
     case ESP_GAP_BLE_SCAN_RESULT_EVT: {
         esp_ble_gap_cb_param_t *p = (esp_ble_gap_cb_param_t *)param;
         ble_scan_result_evt_param_t *r = &p->scan_rst;
 
+        // Publishing happens on ble_publish_task so the BTC task never waits on the network
         if (r->search_evt == ESP_GAP_SEARCH_INQ_CMPL_EVT) {
-            for (int i = 0; i < beacon_cache_count; ++i) {
-                publish_ble_advertisement(&beacon_cache[i]);
-                esp_task_wdt_feed();
+#if BBL_PUBLISH_STATS
+            scan_active = false;
+            scan_millis += bbl_millis() - scan_started_millis;
+#endif
+            // In continuous mode the report timer decides when a window ends
+            if (ble_report_timer == NULL) {
+                xTaskNotifyGive(ble_publish_task);
+            }
+            if (ble_reconfigure_requested) {
+                // The stop missed this window, restart with the new config instead
+                ble_reconfigure_stopped();
+            } else {
+                esp_ble_gap_start_scanning(ble_scan_duration);
             }
-            beacon_cache_count = 0;
+        } else  if (r->search_evt == ESP_GAP_SEARCH_INQ_RES_EVT) {
+            INC_STAT(adversitements_received);
 
-#if BBL_PUBLISH_STATS
-            uint32_t now = bbl_millis();
-            if (now - stats_millis >= STATS_INTERVAL_SEC * 1000) {
-                publish_stats(now - stats_millis);
-                stats_millis = now;
-                esp_task_wdt_feed();
+            if (ble_min_rssi != 0 && r->rssi < ble_min_rssi) {
+                INC_STAT(advertisements_filtered);
+                break;
             }
-#endif
 
-            esp_ble_gap_start_scanning(1);
-        } else  if (r->search_evt == ESP_GAP_SEARCH_INQ_RES_EVT) {
-            beacon_t *beacon = find_beacon(r);
-            beacon->rssi = r->rssi;
-            memcpy(beacon->adv_data, r->ble_adv, sizeof(beacon->adv_data));
-            beacon->adv_data_len = r->adv_data_len;
+            ble_adv_record_t *record = bbl_ring_reserve(&ble_adv_ring);
+            if (record == NULL) {
+                break;
+            }
 
-            INC_STAT(adversitements_received);
+            memcpy(record->mac, r->bda, sizeof(record->mac));
+            record->rssi = r->rssi;
+            // The scan response follows the advertisement data, keep both for the decoders
+            record->adv_data_len = r->adv_data_len + r->scan_rsp_len;
+            memcpy(record->adv_data, r->ble_adv, sizeof(record->adv_data));
+            bbl_ring_commit(&ble_adv_ring);
         }
         break;
     }
@@ -343,6 +1224,18 @@ void bbl_ble_init(void)
     esp_bluedroid_init();
     esp_bluedroid_enable();
 
+    for (int i = 0; i < BBL_SIZEOF_ARRAY(beacon_caches); ++i) {
+        beacon_cache_t *cache = &beacon_caches[i];
+        bbl_mactable_init(&cache->index, cache->index_slots, BBL_SIZEOF_ARRAY(cache->index_slots));
+    }
+    bbl_mactable_init(&beacon_history_index, beacon_history_slots, BBL_SIZEOF_ARRAY(beacon_history_slots));
+    bbl_ring_init(&ble_adv_ring, ble_adv_records, sizeof(ble_adv_records[0]), BBL_SIZEOF_ARRAY(ble_adv_records));
+    bbl_spool_init();
+    xTaskCreate(ble_publish_task_thread, "ble_publish", 8192, NULL, 5, &ble_publish_task);
+    bbl_metrics_add_task(ble_publish_task);
+
+    ble_apply_config();
+
     esp_err_t status;
     if ((status = esp_ble_gap_register_callback(ble_gap_cb)) != ESP_OK) {
         return;
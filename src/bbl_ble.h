@@ -3,6 +3,12 @@
 #ifndef __69834bc4_19ed_4959_bee8_a3fba72d2d64__
 #define __69834bc4_19ed_4959_bee8_a3fba72d2d64__
 
+#include "bbl_metrics.h"
+
 void bbl_ble_init();
+// Applies scan settings changed in the config without a reboot
+void bbl_ble_reconfigure();
+// Scanner and publisher counters, empty unless BBL_PUBLISH_STATS is set
+void bbl_ble_metrics(bbl_metrics_t *metrics);
 
 #endif
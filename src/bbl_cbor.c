@@ -0,0 +1,96 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_cbor.h"
+
+#include <string.h>
+
+enum cbor_major_type {
+    CBOR_UINT  = 0x00,
+    CBOR_NINT  = 0x20,
+    CBOR_BYTES = 0x40,
+    CBOR_TEXT  = 0x60,
+    CBOR_MAP   = 0xa0,
+};
+
+static void cbor_write(bbl_cbor_t *cbor, const void *data, size_t len)
+{
+    if (cbor->overflow || cbor->used + len > cbor->size) {
+        cbor->overflow = true;
+        return;
+    }
+
+    memcpy(cbor->buf + cbor->used, data, len);
+    cbor->used += len;
+}
+
+static void cbor_head(bbl_cbor_t *cbor, uint8_t major, uint64_t value)
+{
+    uint8_t head[9];
+    size_t len;
+
+    if (value < 24) {
+        head[0] = major | value;
+        len = 1;
+    } else if (value <= UINT8_MAX) {
+        head[0] = major | 24;
+        len = 2;
+    } else if (value <= UINT16_MAX) {
+        head[0] = major | 25;
+        len = 3;
+    } else if (value <= UINT32_MAX) {
+        head[0] = major | 26;
+        len = 5;
+    } else {
+        head[0] = major | 27;
+        len = 9;
+    }
+
+    // Argument follows the initial byte in network byte order
+    for (size_t i = len - 1; i > 0; --i) {
+        head[i] = value & 0xff;
+        value >>= 8;
+    }
+
+    cbor_write(cbor, head, len);
+}
+
+void bbl_cbor_init(bbl_cbor_t *cbor, void *buf, size_t size)
+{
+    cbor->buf = buf;
+    cbor->size = size;
+    cbor->used = 0;
+    cbor->overflow = false;
+}
+
+void bbl_cbor_uint(bbl_cbor_t *cbor, uint64_t value)
+{
+    cbor_head(cbor, CBOR_UINT, value);
+}
+
+void bbl_cbor_int(bbl_cbor_t *cbor, int64_t value)
+{
+    if (value < 0) {
+        cbor_head(cbor, CBOR_NINT, (uint64_t)(-1 - value));
+    } else {
+        cbor_head(cbor, CBOR_UINT, (uint64_t)value);
+    }
+}
+
+void bbl_cbor_bytes(bbl_cbor_t *cbor, const void *data, size_t len)
+{
+    cbor_head(cbor, CBOR_BYTES, len);
+    cbor_write(cbor, data, len);
+}
+
+void bbl_cbor_text(bbl_cbor_t *cbor, const char *str)
+{
+    size_t len = strlen(str);
+
+    cbor_head(cbor, CBOR_TEXT, len);
+    cbor_write(cbor, str, len);
+}
+
+void bbl_cbor_map(bbl_cbor_t *cbor, size_t pairs)
+{
+    cbor_head(cbor, CBOR_MAP, pairs);
+}
@@ -0,0 +1,33 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __4ea21f07_d10a_46dd_b078_52635cdcb3a1__
+#define __4ea21f07_d10a_46dd_b078_52635cdcb3a1__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal CBOR (RFC 7049) writer for beacon reports.  Writes past the end of
+// the buffer are dropped and flagged in overflow instead of being reported
+// per call.
+
+#define BBL_CBOR_INDEFINITE_ARRAY 0x9f
+#define BBL_CBOR_BREAK 0xff
+
+typedef struct bbl_cbor bbl_cbor_t;
+
+struct bbl_cbor {
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+    bool overflow;
+};
+
+void bbl_cbor_init(bbl_cbor_t *cbor, void *buf, size_t size);
+void bbl_cbor_uint(bbl_cbor_t *cbor, uint64_t value);
+void bbl_cbor_int(bbl_cbor_t *cbor, int64_t value);
+void bbl_cbor_bytes(bbl_cbor_t *cbor, const void *data, size_t len);
+void bbl_cbor_text(bbl_cbor_t *cbor, const char *str);
+void bbl_cbor_map(bbl_cbor_t *cbor, size_t pairs);
+
+#endif
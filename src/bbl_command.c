@@ -0,0 +1,157 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_command.h"
+#include "bbl_ble.h"
+#include "bbl_config.h"
+#include "bbl_mqtt.h"
+#include "bbl_utils.h"
+#include "bbl_log.h"
+
+#include <jsmn.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest command accepted; larger ones are ignored without being buffered
+#ifndef BBL_COMMAND_MAX
+    #define BBL_COMMAND_MAX 512
+#endif
+#define COMMAND_MAX_TOKENS 33
+
+static char command_topic[64];
+static char command_buf[BBL_COMMAND_MAX];
+
+typedef struct command_key command_key_t;
+
+struct command_key {
+    bbl_config_key_t key;
+    int min;
+    int max;
+    bool rescan;    // Only applied by stopping the scan, see bbl_ble_reconfigure()
+};
+
+// Settings the publisher reads as it goes, or that bbl_ble_reconfigure() applies
+static const command_key_t command_live_keys[] = {
+    { ConfigKeyScanMode,        ScanModeWindowed,   ScanModeContinuous, true  },
+    { ConfigKeyReportInterval,  100,                3600000,            true  },  // ms
+    { ConfigKeyRSSIDelta,       0,                  127,                false },  // dB
+    { ConfigKeyHeartbeat,       0,                  86400,              false },  // s
+    { ConfigKeyBatchMax,        256,                4096,               false },  // bytes, up to the batch buffer
+    { ConfigKeyEncoding,        EncodingJSON,       EncodingCBOR,       false },
+    { ConfigKeyScanInterval,    3,                  10240,              true  },  // ms, as far as the controller goes
+    { ConfigKeyScanWindow,      3,                  10240,              true  },  // ms
+    { ConfigKeyMinRSSI,         -127,               0,                  true  },  // dBm, 0 = off
+};
+
+static const command_key_t *command_live_key(bbl_config_key_t key)
+{
+    for (int i = 0; i < BBL_SIZEOF_ARRAY(command_live_keys); ++i) {
+        if (command_live_keys[i].key == key) {
+            return &command_live_keys[i];
+        }
+    }
+
+    return NULL;
+}
+
+static size_t jsmn_len(const jsmntok_t *t)
+{
+    return t->end - t->start;
+}
+
+static bool command_apply(const jsmntok_t *name, const jsmntok_t *value, bool *rescan)
+{
+    char key_name[16];
+    const char *v = command_buf + value->start;
+    int int_val;
+
+    if (name->type != JSMN_STRING || value->type != JSMN_PRIMITIVE || jsmn_len(name) >= sizeof(key_name)) {
+        return false;
+    }
+
+    memcpy(key_name, command_buf + name->start, jsmn_len(name));
+    key_name[jsmn_len(name)] = '\0';
+
+    const command_key_t *live = command_live_key(bbl_config_lookup_key(key_name));
+    if (live == NULL) {
+        return false;
+    }
+
+    // true and false for the same keys the config page shows as checkboxes
+    if (*v == 't' || *v == 'f') {
+        int_val = (*v == 't');
+    } else if (*v == '-' || (*v >= '0' && *v <= '9')) {
+        int_val = atoi(v);
+    } else {
+        return false;
+    }
+
+    if (int_val < live->min || int_val > live->max) {
+        BBL_LOG("Command rejected %s = %d, must be %d to %d", key_name, int_val, live->min, live->max);
+        return false;
+    }
+
+    bbl_config_set_int(live->key, int_val);
+    *rescan |= live->rescan;
+
+    BBL_LOG("Command set %s to %d", key_name, int_val);
+    return true;
+}
+
+static void command_run(size_t len)
+{
+    jsmn_parser parser;
+    jsmntok_t tokens[COMMAND_MAX_TOKENS];
+    unsigned int applied = 0;
+    unsigned int rejected = 0;
+    bool rescan = false;
+    char result_topic[sizeof(command_topic) + 8];
+    char result[64];
+
+    jsmn_init(&parser);
+    int token_count = jsmn_parse(&parser, command_buf, len, tokens, BBL_SIZEOF_ARRAY(tokens));
+
+    // Only a flat object, so keys and values simply alternate
+    if (token_count < 1 || tokens[0].type != JSMN_OBJECT || token_count != 1 + 2 * tokens[0].size) {
+        BBL_LOG("Ignoring malformed command");
+        return;
+    }
+
+    for (int i = 1; i + 1 < token_count; i += 2) {
+        if (command_apply(&tokens[i], &tokens[i + 1], &rescan)) {
+            ++applied;
+        } else {
+            ++rejected;
+        }
+    }
+
+    if (applied > 0) {
+        bbl_config_save();
+    }
+    if (rescan) {
+        bbl_ble_reconfigure();
+    }
+
+    bbl_snprintf(result_topic, sizeof(result_topic), "%s/result", command_topic);
+    size_t result_len = bbl_snprintf(result, sizeof(result), "{\"applied\":%u,\"rejected\":%u}", applied, rejected);
+    bbl_mqtt_publish(result_topic, result, result_len);
+}
+
+static void command_handler(const char *topic, const uint8_t *data, size_t len, size_t offset, size_t total)
+{
+    if (total > sizeof(command_buf)) {
+        BBL_LOGIF(offset == 0, "Ignoring %u byte command", (unsigned int)total);
+        return;
+    }
+
+    memcpy(command_buf + offset, data, len);
+
+    if (offset + len == total) {
+        command_run(total);
+    }
+}
+
+void bbl_command_init()
+{
+    bbl_snprintf(command_topic, sizeof(command_topic), "happy-bubbles/command/%s", bbl_config_get_string(ConfigKeyHostname));
+    bbl_mqtt_subscribe(command_topic, command_handler);
+}
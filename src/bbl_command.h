@@ -0,0 +1,14 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __7a4c2e91_3b8d_4f06_a5e2_c19d84f0b637__
+#define __7a4c2e91_3b8d_4f06_a5e2_c19d84f0b637__
+
+// Listens on happy-bubbles/command/<hostname> for a JSON object of config keys to change, e.g.
+// {"scan_itvl": 100, "report_ms": 500}.  Only settings that can be applied without a reboot are
+// accepted, and only within their range; they take effect immediately and are saved.  The
+// outcome, including how many values were rejected, is published to the same topic with /result
+// appended.
+
+void bbl_command_init();
+
+#endif
@@ -46,6 +46,21 @@ static bbl_config_item_t bbl_config_items[] =
     { "mqtt_tls",   IntValue,    { .int_val = 0              }, { .int_val = 0    }, false },
     { "mqtt_user",  StringValue, { .str_val = ""             }, { .str_val = NULL }, false },
     { "mqtt_pass",  StringValue, { .str_val = ""             }, { .str_val = NULL }, false },
+
+    { "scan_mode",  IntValue,    { .int_val = 0              }, { .int_val = 0    }, false },
+    { "report_ms",  IntValue,    { .int_val = 1000           }, { .int_val = 0    }, false },
+    { "rssi_delta", IntValue,    { .int_val = 3              }, { .int_val = 0    }, false },
+    { "heartbeat",  IntValue,    { .int_val = 10             }, { .int_val = 0    }, false },
+    { "batch_max",  IntValue,    { .int_val = 0              }, { .int_val = 0    }, false },
+    { "encoding",   IntValue,    { .int_val = 0              }, { .int_val = 0    }, false },
+    { "keepalive",  IntValue,    { .int_val = 60             }, { .int_val = 0    }, false },
+    { "mqtt_qos",   IntValue,    { .int_val = 0              }, { .int_val = 0    }, false },
+    { "inflight",   IntValue,    { .int_val = 8              }, { .int_val = 0    }, false },
+    { "mqtt_v5",    IntValue,    { .int_val = 0              }, { .int_val = 0    }, false },
+    { "scan_itvl",  IntValue,    { .int_val = 50             }, { .int_val = 0    }, false },
+    { "scan_win",   IntValue,    { .int_val = 30             }, { .int_val = 0    }, false },
+    { "min_rssi",   IntValue,    { .int_val = 0              }, { .int_val = 0    }, false },
+    { "nodelay",    IntValue,    { .int_val = 1              }, { .int_val = 0    }, false },
 };
 
 BBL_STATIC_ASSERT(BBL_SIZEOF_ARRAY(bbl_config_items) == ConfigKeyCount);
@@ -256,3 +271,13 @@ const char *bbl_config_boot_mode_string(bbl_boot_mode_t boot_mode)
     case BootModeConfig: return "config";
     }
 }
+
+const char *bbl_config_scan_mode_string(bbl_scan_mode_t scan_mode)
+{
+    switch (scan_mode) {
+    case ScanModeWindowed: return "windowed";
+    case ScanModeContinuous: return "continuous";
+    }
+
+    return "unknown";
+}
@@ -8,6 +8,8 @@
 
 typedef enum bbl_config_key bbl_config_key_t;
 typedef enum bbl_boot_mode bbl_boot_mode_t;
+typedef enum bbl_scan_mode bbl_scan_mode_t;
+typedef enum bbl_encoding bbl_encoding_t;
 
 enum bbl_config_key {
     ConfigKeyVersion,
@@ -28,6 +30,24 @@ enum bbl_config_key {
     ConfigKeyMQTTUser,
     ConfigKeyMQTTPass,
 
+    ConfigKeyScanMode,
+    ConfigKeyReportInterval,
+    // A beacon is only republished when its advertisement changed, its RSSI moved by at least
+    // rssi_delta dB, or heartbeat seconds have passed.  rssi_delta 0 publishes every beacon in
+    // every window; heartbeat 0 never republishes an unchanged one.
+    ConfigKeyRSSIDelta,
+    ConfigKeyHeartbeat,
+    ConfigKeyBatchMax,
+    ConfigKeyEncoding,
+    ConfigKeyKeepalive,
+    ConfigKeyMQTTQoS,
+    ConfigKeyInflight,
+    ConfigKeyMQTTv5,
+    ConfigKeyScanInterval,
+    ConfigKeyScanWindow,
+    ConfigKeyMinRSSI,
+    ConfigKeyNoDelay,
+
     ConfigKeyCount
 };
 
@@ -36,6 +56,16 @@ enum bbl_boot_mode {
     BootModeConfig,
 };
 
+enum bbl_scan_mode {
+    ScanModeWindowed,   // 1s scans, report at each scan completion
+    ScanModeContinuous, // Never stop scanning, report every report_ms
+};
+
+enum bbl_encoding {
+    EncodingJSON,
+    EncodingCBOR,
+};
+
 void bbl_config_reset();
 void bbl_config_init();
 void bbl_config_save();
@@ -49,5 +79,6 @@ void bbl_config_set_string(bbl_config_key_t key, const char *value);
 void bbl_config_set_int(bbl_config_key_t key, int value);
 
 const char *bbl_config_boot_mode_string(bbl_boot_mode_t boot_mode);
+const char *bbl_config_scan_mode_string(bbl_scan_mode_t scan_mode);
 
 #endif
@@ -2,22 +2,54 @@
 
 #include "bbl_httpd.h"
 #include "bbl_config.h"
+#include "bbl_metrics.h"
 #include "bbl_ota.h"
 #include "bbl_utils.h"
 #include "bbl_wifi.h"
 #include "bbl_httpd_resources.h"
+#include "bbl_log.h"
 
 #include <esp_ota_ops.h>
 #include <http_parser.h>
 #include <lwip/sockets.h>
+#include <mbedtls/sha256.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define HTTP_BUFSIZ 8192
+// Connections served at once; more wait in the listen backlog
+#ifndef BBL_HTTPD_CLIENTS
+    #define BBL_HTTPD_CLIENTS 4
+#endif
+// Outside config mode only /metrics is served, to one scraper at a time, which needs far less
+// request buffer and stack.  The task's stack headroom is itself in /metrics.
+#ifndef BBL_HTTPD_METRICS_CLIENTS
+    #define BBL_HTTPD_METRICS_CLIENTS 1
+#endif
+#ifndef BBL_HTTPD_METRICS_BUFSIZ
+    #define BBL_HTTPD_METRICS_BUFSIZ 1024
+#endif
+#ifndef BBL_HTTPD_METRICS_STACK
+    #define BBL_HTTPD_METRICS_STACK 4096
+#endif
+// Metrics go out as chunks of up to this much
+#define HTTPD_METRICS_CHUNK 512
+// Connections that go this long without sending anything are dropped
+#ifndef BBL_HTTPD_IDLE_MS
+    #define BBL_HTTPD_IDLE_MS 10000
+#endif
+#define HTTPD_SELECT_MS 1000
+// Longest a response write may block on a client that stopped reading
+#define HTTPD_SEND_TIMEOUT_MS 2000
+// Firmware upload progress is logged each time this much more has been written
+#define HTTPD_UPLOAD_LOG_BYTES (64 * 1024)
 
 typedef struct http_client http_client_t;
 typedef struct http_parser_url http_parser_url_t;
 typedef struct http_keyvalue http_keyvalue_t;
+typedef struct httpd_upload httpd_upload_t;
 
 struct http_keyvalue
 {
@@ -30,7 +62,9 @@ struct http_client
     http_parser parser;
     http_parser_settings parser_settings;
     http_parser_url_t url;
-    int sock;
+    int sock;                   // -1 while the slot is free
+    uint32_t last_active;
+    bool keep_alive;
 
     bool headers_complete;
     bool parsing_complete;
@@ -44,14 +78,45 @@ struct http_client
 
     char *body;
     size_t body_len;
+    char body_end;              // Overwritten by the body's terminator, may start the next request
+
+    bool upload;                // Body is a firmware image, written to flash as it arrives
+    const char *upload_status;  // Set when the upload is refused or fails, answered right away
+    const char *upload_error;
 
     int argc;
     http_keyvalue_t argv[32];
 
-    char buf[HTTP_BUFSIZ];
+    char *buf;                  // buf_size bytes, allocated with the slot
+    size_t buf_size;
     size_t buf_used;
+    size_t buf_parsed;          // Anything after this belongs to the next pipelined request
 };
 
+// Only one image can be written to the OTA partition at a time
+struct httpd_upload
+{
+    http_client_t *client;      // NULL while no upload is running
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    mbedtls_sha256_context sha;
+    uint8_t digest[32];         // What the client says the image hashes to
+    const char *state;
+    size_t received;
+    size_t total;               // 0 for a chunked upload that didn't say how big it is
+    size_t logged;
+};
+
+static bool httpd_config_mode;
+static int httpd_client_count;
+static size_t httpd_buf_size;
+static httpd_upload_t httpd_upload = { .state = "idle" };
+
+static bool httpd_check_url(http_client_t *client, const char *url);
+static void httpd_upload_begin(http_client_t *client);
+static void httpd_upload_write(http_client_t *client, const char *at, size_t length);
+static void httpd_close_client(http_client_t *client);
+
 static char *sanitize_hostname(char *str)
 {
     for (char *p = str; *p; ++p) {
@@ -190,8 +255,13 @@ static int httpd_on_headers_complete(http_parser* parser)
         }
     }
 
+    client->keep_alive = http_should_keep_alive(parser);
     client->headers_complete = true;
 
+    if (parser->method == HTTP_POST && httpd_check_url(client, "/firmware")) {
+        httpd_upload_begin(client);
+    }
+
     return 0;
 }
 
@@ -199,6 +269,11 @@ static int httpd_on_body(http_parser* parser, const char *at, size_t length)
 {
     http_client_t *client = parser->data;
 
+    if (client->upload) {
+        httpd_upload_write(client, at, length);
+        return 0;
+    }
+
     if (!client->body) {
         client->body = (char *)at;
     }
@@ -212,6 +287,7 @@ static int httpd_on_message_complete(http_parser *parser)
     http_client_t *client = parser->data;
 
     if (client->body) {
+        client->body_end = client->body[client->body_len];
         client->body[client->body_len] = 0;
 
         if (parser->method == HTTP_POST) {
@@ -221,12 +297,26 @@ static int httpd_on_message_complete(http_parser *parser)
 
     client->parsing_complete = true;
 
+    // Stop here so a pipelined request behind this one isn't parsed over it
+    http_parser_pause(parser, 1);
+
     return 0;
 }
 
-static void httpd_client_init(http_client_t *client, int sock)
+// Gets ready for the next request on the same connection, keeping whatever of it was already read
+static void httpd_client_reset(http_client_t *client)
 {
-    memset(client, 0, sizeof(*client));
+    int sock = client->sock;
+    uint32_t last_active = client->last_active;
+    size_t leftover = client->buf_used - client->buf_parsed;
+
+    if (client->body != NULL) {
+        client->body[client->body_len] = client->body_end;
+    }
+    memmove(client->buf, client->buf + client->buf_parsed, leftover);
+
+    // Everything up to buf is per request
+    memset(client, 0, offsetof(http_client_t, buf));
 
     http_parser_init(&client->parser, HTTP_REQUEST);
     client->parser.data = client;
@@ -234,16 +324,10 @@ static void httpd_client_init(http_client_t *client, int sock)
     http_parser_url_init(&client->url);
 
     client->sock = sock;
-    //client->headers_complete = false;
-    //client->parsing_complete = false;
-    //client->buf_used = 0;
+    client->last_active = last_active;
     client->headers_count = -1;
-    //client->headers_end = NULL;
-    //client->uri = NULL;
-    //client->uri_len = 0;
-    //client->body = NULL;
-    //client->body_len = 0;
-    //client->argc = 0;
+    client->buf_used = leftover;
+    client->buf_parsed = 0;
 
     client->parser_settings.on_url = httpd_on_url;
     client->parser_settings.on_header_field = httpd_on_header_field;
@@ -253,51 +337,170 @@ static void httpd_client_init(http_client_t *client, int sock)
     client->parser_settings.on_message_complete = httpd_on_message_complete;
 }
 
-static void httpd_read_headers(http_client_t *client)
+static void httpd_client_init(http_client_t *client, int sock)
+{
+    client->sock = sock;
+    client->last_active = bbl_millis();
+    client->body = NULL;
+    client->buf_used = 0;
+    client->buf_parsed = 0;
+    httpd_client_reset(client);
+}
+
+// Feeds the parser what it hasn't seen yet, stopping at the end of a request
+static bool httpd_client_parse(http_client_t *client)
 {
-    do {
-        char *p = client->buf + client->buf_used;
-        int n = sizeof(client->buf) - client->buf_used - 1;
+    char *p = client->buf + client->buf_parsed;
 
-        if ((n = read(client->sock, p, n)) <= 0) {
-            break;
+    client->buf_parsed += http_parser_execute(&client->parser, &client->parser_settings, p, client->buf_used - client->buf_parsed);
+
+    // An upload's body has already gone to flash, so the buffer can take the next piece of it
+    if (client->upload && !client->parsing_complete) {
+        memmove(client->buf, client->buf + client->buf_parsed, client->buf_used - client->buf_parsed);
+        client->buf_used -= client->buf_parsed;
+        client->buf_parsed = 0;
+    }
+
+    return HTTP_PARSER_ERRNO(&client->parser) == HPE_OK || HTTP_PARSER_ERRNO(&client->parser) == HPE_PAUSED;
+}
+
+// Parses whatever has arrived without blocking.  Returns false once the connection should be
+// closed: on EOF, a read error, a malformed request or one that doesn't fit the buffer.
+static bool httpd_client_read(http_client_t *client)
+{
+    char *p = client->buf + client->buf_used;
+    int n = client->buf_size - client->buf_used - 1;
+
+    if (n <= 0 || (n = read(client->sock, p, n)) <= 0) {
+        return false;
+    }
+
+    client->buf_used += n;
+    client->last_active = bbl_millis();
+
+    return httpd_client_parse(client);
+}
+
+static const char *httpd_get_header(http_client_t *client, const char *name)
+{
+    for (int i = 0; i < client->headers_count; ++i) {
+        if (strcasecmp(client->headers[i].key, name) == 0) {
+            return client->headers[i].value;
         }
+    }
 
-        http_parser_execute(&client->parser, &client->parser_settings, p, n);
-        client->buf_used += n;
-    } while (!client->headers_complete && client->buf_used + 1 < sizeof(client->buf));
+    return NULL;
 }
 
-static void httpd_read_body(http_client_t *client)
+static bool httpd_header_contains(http_client_t *client, const char *name, const char *token)
 {
-    while (!client->parsing_complete && client->buf_used + 1 < sizeof(client->buf)) {
-        char *p = client->buf + client->buf_used;
-        int n = sizeof(client->buf) - client->buf_used - 1;
+    const char *value = httpd_get_header(client, name);
 
-        if ((n = read(client->sock, p, n)) <= 0) {
-            break;
+    return value != NULL && strstr(value, token) != NULL;
+}
+
+// A short write would leave the client reading the rest of this response as the next one, so on
+// a failure or send timeout the connection is closed instead
+static bool httpd_write_all(http_client_t *client, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len > 0) {
+        int n = (client->sock == -1) ? -1 : write(client->sock, p, len);
+
+        if (n <= 0) {
+            client->keep_alive = false;
+            httpd_close_client(client);
+            return false;
         }
 
-        http_parser_execute(&client->parser, &client->parser_settings, p, n);
-        client->buf_used += n;
+        p += n;
+        len -= n;
     }
+
+    return true;
 }
 
-static void httpd_get_index(http_client_t *client)
+// Every response carries its length so the connection can be reused for the next request.
+// extra_headers is empty or whole lines, each ending in CRLF.
+static void httpd_respond(http_client_t *client, const char *status, const char *content_type, const char *extra_headers,
+    const void *body, size_t body_len)
 {
-    write(client->sock, BBL_STRING_LITERAL_PARAM(
-        "HTTP/1.1 200 OK\r\n"
-        "Connection: Close\r\n"
-        "Content-Type: text/html\r\n"
-        "\r\n"
-    ));
+    char header[320];
+    size_t header_len;
+
+    header_len = bbl_snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %u\r\n"
+        "%s"
+        "%s"
+        "\r\n",
+        status,
+        content_type,
+        (unsigned int)body_len,
+        extra_headers,
+        client->keep_alive ? "" : "Connection: close\r\n"
+    );
 
-    write(client->sock, BBL_RESOURCE(index), BBL_SIZEOF_RESOURCE(index));
+    if (httpd_write_all(client, header, header_len)) {
+        httpd_write_all(client, body, body_len);
+    }
+}
+
+// Static resources only change with the firmware, so the hash bump_version.py takes of them
+// makes a strong ETag.  Each encoding gets its own, as strong ETags must.
+static void httpd_send_resource(http_client_t *client, const char *content_type, const uint8_t *data, size_t len,
+    const uint8_t *gzipped, size_t gzipped_len)
+{
+    static const char etag[] = "\"" BBL_HTTPD_RESOURCES_HASH "\"";
+    static const char etag_gzip[] = "\"" BBL_HTTPD_RESOURCES_HASH "-gz\"";
+    bool gzip = gzipped != NULL && httpd_header_contains(client, "Accept-Encoding", "gzip");
+    const char *tag = gzip ? etag_gzip : etag;
+    char headers[128];
+
+    bbl_snprintf(headers, sizeof(headers),
+        "ETag: %s\r\n"
+        "Cache-Control: no-cache\r\n"
+        "%s",
+        tag,
+        gzip ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : (gzipped != NULL ? "Vary: Accept-Encoding\r\n" : "")
+    );
+
+    if (httpd_header_contains(client, "If-None-Match", tag)) {
+        char response[256];
+        size_t response_len;
+
+        // No body, and no Content-Length since it would have to be that of the full response
+        response_len = bbl_snprintf(response, sizeof(response),
+            "HTTP/1.1 304 Not Modified\r\n"
+            "%s"
+            "%s"
+            "\r\n",
+            headers,
+            client->keep_alive ? "" : "Connection: close\r\n"
+        );
+
+        httpd_write_all(client, response, response_len);
+        return;
+    }
+
+    if (gzip) {
+        httpd_respond(client, "200 OK", content_type, headers, gzipped, gzipped_len);
+    } else {
+        httpd_respond(client, "200 OK", content_type, headers, data, len);
+    }
+}
+
+static void httpd_get_index(http_client_t *client)
+{
+    httpd_send_resource(client, "text/html", BBL_RESOURCE(index), BBL_SIZEOF_RESOURCE(index),
+        BBL_RESOURCE(index_gz), BBL_SIZEOF_RESOURCE(index_gz));
 }
 
 static void httpd_get_config(http_client_t *client)
 {
-    char response[512];
+    char response[1024];
     size_t response_len;
 
     response_len = bbl_snprintf(response, sizeof(response),
@@ -307,43 +510,59 @@ static void httpd_get_config(http_client_t *client)
             "\"mqtt_host\": \"%js\","
             "\"mqtt_port\": %u,"
             "\"mqtt_tls\": %s,"
-            "\"mqtt_user\": \"%js\""
+            "\"mqtt_user\": \"%js\","
+            "\"scan_mode\": %s,"
+            "\"report_ms\": %u,"
+            "\"rssi_delta\": %u,"
+            "\"heartbeat\": %u,"
+            "\"batch_max\": %u,"
+            "\"encoding\": %s,"
+            "\"keepalive\": %u,"
+            "\"mqtt_qos\": %s,"
+            "\"inflight\": %u,"
+            "\"mqtt_v5\": %s,"
+            "\"scan_itvl\": %u,"
+            "\"scan_win\": %u,"
+            "\"min_rssi\": %d,"
+            "\"nodelay\": %s"
         "}",
         bbl_config_get_string(ConfigKeyHostname),
         bbl_config_get_string(ConfigKeyWiFiSSID),
         bbl_config_get_string(ConfigKeyMQTTHost),
         bbl_config_get_int(ConfigKeyMQTTPort),
         bbl_config_get_int(ConfigKeyMQTTTLS) ? "true" : "false",
-        bbl_config_get_string(ConfigKeyMQTTUser)
+        bbl_config_get_string(ConfigKeyMQTTUser),
+        bbl_config_get_int(ConfigKeyScanMode) == ScanModeContinuous ? "true" : "false",
+        bbl_config_get_int(ConfigKeyReportInterval),
+        bbl_config_get_int(ConfigKeyRSSIDelta),
+        bbl_config_get_int(ConfigKeyHeartbeat),
+        bbl_config_get_int(ConfigKeyBatchMax),
+        bbl_config_get_int(ConfigKeyEncoding) == EncodingCBOR ? "true" : "false",
+        bbl_config_get_int(ConfigKeyKeepalive),
+        bbl_config_get_int(ConfigKeyMQTTQoS) ? "true" : "false",
+        bbl_config_get_int(ConfigKeyInflight),
+        bbl_config_get_int(ConfigKeyMQTTv5) ? "true" : "false",
+        bbl_config_get_int(ConfigKeyScanInterval),
+        bbl_config_get_int(ConfigKeyScanWindow),
+        bbl_config_get_int(ConfigKeyMinRSSI),
+        bbl_config_get_int(ConfigKeyNoDelay) ? "true" : "false"
     );
 
-    write(client->sock, BBL_STRING_LITERAL_PARAM(
-        "HTTP/1.1 200 OK\r\n"
-        "Connection: Close\r\n"
-        "Content-Type: application/json\r\n"
-        "\r\n"
-    ));
-
-    write(client->sock, response, response_len);
+    httpd_respond(client, "200 OK", "application/json", "", response, response_len);
 }
 
 static void httpd_post_config(http_client_t *client)
 {
-    httpd_read_body(client);
-
-    if (!client->parsing_complete) {
-        return;
-    }
-
-    write(client->sock, BBL_STRING_LITERAL_PARAM(
-        "HTTP/1.1 200 OK\r\n"
-        "Connection: Close\r\n"
-        "Content-Type: text/html\r\n"
-        "\r\n"
-        "Configuration applied!  Rebooting."
-    ));
+    // We are about to reboot
+    client->keep_alive = false;
+    httpd_respond(client, "200 OK", "text/html", "", BBL_STRING_LITERAL_PARAM("Configuration applied!  Rebooting."));
 
     bbl_config_set_int(ConfigKeyMQTTTLS, false);
+    bbl_config_set_int(ConfigKeyMQTTQoS, false);
+    bbl_config_set_int(ConfigKeyMQTTv5, false);
+    bbl_config_set_int(ConfigKeyNoDelay, false);
+    bbl_config_set_int(ConfigKeyScanMode, ScanModeWindowed);
+    bbl_config_set_int(ConfigKeyEncoding, EncodingJSON);
 
     for (int i = 0; i < client->argc; ++i) {
         bbl_config_key_t key = bbl_config_lookup_key(client->argv[i].key);
@@ -367,12 +586,32 @@ static void httpd_post_config(http_client_t *client)
             break;
 
         case ConfigKeyMQTTPort:
+        case ConfigKeyReportInterval:
+        case ConfigKeyRSSIDelta:
+        case ConfigKeyHeartbeat:
+        case ConfigKeyBatchMax:
+        case ConfigKeyKeepalive:
+        case ConfigKeyInflight:
+        case ConfigKeyScanInterval:
+        case ConfigKeyScanWindow:
+        case ConfigKeyMinRSSI:
             bbl_config_set_int(key, atoi(client->argv[i].value));
             break;
 
         case ConfigKeyMQTTTLS:
+        case ConfigKeyMQTTQoS:
+        case ConfigKeyMQTTv5:
+        case ConfigKeyNoDelay:
             bbl_config_set_int(key, true);
             break;
+
+        case ConfigKeyScanMode:
+            bbl_config_set_int(key, ScanModeContinuous);
+            break;
+
+        case ConfigKeyEncoding:
+            bbl_config_set_int(key, EncodingCBOR);
+            break;
         }
     }
 
@@ -384,14 +623,8 @@ static void httpd_post_config(http_client_t *client)
 
 static void httpd_get_favicon(http_client_t *client)
 {
-    write(client->sock, BBL_STRING_LITERAL_PARAM(
-        "HTTP/1.1 200 OK\r\n"
-        "Connection: Close\r\n"
-        "Content-Type: image/png\r\n"
-        "\r\n"
-    ));
-
-    write(client->sock, BBL_RESOURCE(favicon), BBL_SIZEOF_RESOURCE(favicon));
+    // Already compressed
+    httpd_send_resource(client, "image/png", BBL_RESOURCE(favicon), BBL_SIZEOF_RESOURCE(favicon), NULL, 0);
 }
 
 static void httpd_update_check(http_client_t *client)
@@ -406,14 +639,7 @@ static void httpd_update_check(http_client_t *client)
         bbl_ota_update_available() ? "true" : "false"
     );
 
-    write(client->sock, BBL_STRING_LITERAL_PARAM(
-        "HTTP/1.1 200 OK\r\n"
-        "Connection: Close\r\n"
-        "Content-Type: application/json\r\n"
-        "\r\n"
-    ));
-
-    write(client->sock, response, response_len);
+    httpd_respond(client, "200 OK", "application/json", "", response, response_len);
 }
 
 static void httpd_download_update(http_client_t *client)
@@ -426,27 +652,280 @@ static void httpd_download_update(http_client_t *client)
         bbl_ota_update_available() ? "true" : "false"
     );
 
-    write(client->sock, BBL_STRING_LITERAL_PARAM(
-        "HTTP/1.1 200 OK\r\n"
-        "Connection: Close\r\n"
-        "Content-Type: application/json\r\n"
-        "\r\n"
-    ));
-
-    write(client->sock, response, response_len);
+    httpd_respond(client, "200 OK", "application/json", "", response, response_len);
 
     bbl_ota_download_update();
 }
 
+// Answers the upload as soon as the parser returns rather than reading the rest of an image that
+// would be thrown away
+static void httpd_upload_refuse(http_client_t *client, const char *status, const char *error)
+{
+    client->upload_status = status;
+    client->upload_error = error;
+    client->parsing_complete = true;
+    http_parser_pause(&client->parser, 1);
+}
+
+static void httpd_upload_abort()
+{
+    if (httpd_upload.client == NULL) {
+        return;
+    }
+
+    // Only frees the handle; the partition that was being written stays unbootable
+    esp_ota_end(httpd_upload.handle);
+    mbedtls_sha256_free(&httpd_upload.sha);
+    httpd_upload.client = NULL;
+    httpd_upload.state = "failed";
+}
+
+static bool httpd_parse_digest(const char *hex, uint8_t *digest)
+{
+    if (strlen(hex) != 64) {
+        return false;
+    }
+
+    for (int i = 0; i < 32; ++i) {
+        int b = pack_byte(&hex[i * 2]);
+
+        if (b < 0) {
+            return false;
+        }
+        digest[i] = b;
+    }
+
+    return true;
+}
+
+// Called once the upload's headers are in.  The image's SHA-256 must be given up front so it can
+// be checked as the image streams past, without reading it back from flash.
+static void httpd_upload_begin(http_client_t *client)
+{
+    const char *digest = httpd_get_header(client, "X-Firmware-SHA256");
+
+    client->upload = true;
+
+    // The config has no password to put this behind, so like every other endpoint that changes
+    // the device it needs someone to have put the node into config mode
+    if (!httpd_config_mode) {
+        httpd_upload_refuse(client, "403 Forbidden", "Firmware uploads need config mode");
+        return;
+    }
+
+    if (httpd_upload.client != NULL) {
+        httpd_upload_refuse(client, "409 Conflict", "Another upload is in progress");
+        return;
+    }
+
+    if (digest == NULL || !httpd_parse_digest(digest, httpd_upload.digest)) {
+        httpd_upload_refuse(client, "400 Bad Request", "X-Firmware-SHA256 must be the image's SHA-256 in hex");
+        return;
+    }
+
+    // The parser decodes a chunked body as it arrives, so only its size is missing.  A client that
+    // knows it can send X-Firmware-Size, otherwise esp_ota_begin() erases the whole partition,
+    // which takes seconds during which this task serves nobody else.
+    size_t total = 0;
+    if ((client->parser.flags & F_CHUNKED) != 0) {
+        const char *size = httpd_get_header(client, "X-Firmware-Size");
+        char *end;
+
+        if (size != NULL) {
+            total = strtoul(size, &end, 10);
+            if (*size == '\0' || *end != '\0') {
+                httpd_upload_refuse(client, "400 Bad Request", "X-Firmware-Size must be the image's size in bytes");
+                return;
+            }
+        }
+    } else if ((client->parser.flags & F_CONTENTLENGTH) != 0) {
+        total = client->parser.content_length;
+    } else {
+        httpd_upload_refuse(client, "411 Length Required", "Send the image with a Content-Length or chunked");
+        return;
+    }
+
+    if (total == 0 && (client->parser.flags & F_CHUNKED) == 0) {
+        httpd_upload_refuse(client, "400 Bad Request", "Not a firmware image");
+        return;
+    }
+
+    httpd_upload.partition = esp_ota_get_next_update_partition(NULL);
+    if (httpd_upload.partition == NULL) {
+        httpd_upload_refuse(client, "500 Internal Server Error", "No OTA partition");
+        return;
+    }
+
+    if (total > httpd_upload.partition->size) {
+        httpd_upload_refuse(client, "413 Payload Too Large", "Image is larger than the OTA partition");
+        return;
+    }
+
+    // Only erases what the image needs, when that's known
+    if (esp_ota_begin(httpd_upload.partition, (total != 0) ? total : OTA_SIZE_UNKNOWN, &httpd_upload.handle) != ESP_OK) {
+        httpd_upload_refuse(client, "500 Internal Server Error", "Couldn't start the update");
+        return;
+    }
+
+    mbedtls_sha256_init(&httpd_upload.sha);
+    mbedtls_sha256_starts(&httpd_upload.sha, 0);
+    httpd_upload.client = client;
+    httpd_upload.state = "receiving";
+    httpd_upload.received = 0;
+    httpd_upload.total = total;
+    httpd_upload.logged = 0;
+
+    if (total != 0) {
+        BBL_LOG("Receiving firmware upload (%u bytes)", (unsigned int)total);
+    } else {
+        BBL_LOG("Receiving firmware upload (chunked)");
+    }
+
+    // curl holds large bodies back for a second unless told to go ahead
+    // Closing the connection also aborts the upload just started
+    if (httpd_header_contains(client, "Expect", "100-continue")) {
+        httpd_write_all(client, BBL_STRING_LITERAL_PARAM("HTTP/1.1 100 Continue\r\n\r\n"));
+    }
+}
+
+static void httpd_upload_write(http_client_t *client, const char *at, size_t length)
+{
+    esp_err_t err;
+
+    if (httpd_upload.client != client) {
+        return;
+    }
+
+    // Nothing past the declared size was erased
+    if (httpd_upload.total != 0 && httpd_upload.received + length > httpd_upload.total) {
+        httpd_upload_abort();
+        httpd_upload_refuse(client, "400 Bad Request", "Image is longer than X-Firmware-Size");
+        return;
+    }
+
+    mbedtls_sha256_update(&httpd_upload.sha, (const unsigned char *)at, length);
+
+    if ((err = esp_ota_write(httpd_upload.handle, at, length)) != ESP_OK) {
+        httpd_upload_abort();
+
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+            httpd_upload_refuse(client, "400 Bad Request", "Not a firmware image");
+        } else if (err == ESP_ERR_INVALID_SIZE) {
+            httpd_upload_refuse(client, "413 Payload Too Large", "Image is larger than the OTA partition");
+        } else {
+            httpd_upload_refuse(client, "500 Internal Server Error", "Flash write failed");
+        }
+        return;
+    }
+
+    httpd_upload.received += length;
+    if (httpd_upload.received - httpd_upload.logged >= HTTPD_UPLOAD_LOG_BYTES) {
+        httpd_upload.logged = httpd_upload.received;
+        BBL_LOG("Wrote %u/%u firmware bytes", (unsigned int)httpd_upload.received, (unsigned int)httpd_upload.total);
+    }
+}
+
+static void httpd_post_firmware(http_client_t *client)
+{
+    uint8_t digest[32];
+
+    // Either rebooting, or the rest of a refused body is still on its way
+    client->keep_alive = false;
+
+    if (client->upload_status != NULL) {
+        httpd_respond(client, client->upload_status, "text/plain", "", client->upload_error, strlen(client->upload_error));
+        return;
+    }
+
+    mbedtls_sha256_finish(&httpd_upload.sha, digest);
+    if (memcmp(digest, httpd_upload.digest, sizeof(digest)) != 0) {
+        httpd_upload_abort();
+        httpd_respond(client, "400 Bad Request", "text/plain", "", BBL_STRING_LITERAL_PARAM("SHA-256 mismatch"));
+        return;
+    }
+
+    mbedtls_sha256_free(&httpd_upload.sha);
+    httpd_upload.client = NULL;
+
+    if (esp_ota_end(httpd_upload.handle) != ESP_OK) {
+        httpd_upload.state = "failed";
+        httpd_respond(client, "400 Bad Request", "text/plain", "", BBL_STRING_LITERAL_PARAM("Image failed validation"));
+        return;
+    }
+
+    if (esp_ota_set_boot_partition(httpd_upload.partition) != ESP_OK) {
+        httpd_upload.state = "failed";
+        httpd_respond(client, "500 Internal Server Error", "text/plain", "", BBL_STRING_LITERAL_PARAM("Couldn't select the new image"));
+        return;
+    }
+
+    httpd_upload.state = "rebooting";
+    httpd_respond(client, "200 OK", "text/plain", "", BBL_STRING_LITERAL_PARAM("Firmware updated!  Rebooting."));
+
+    bbl_config_set_int(ConfigKeyBootMode, BootModeNormal);
+    bbl_config_save();
+    close(client->sock);
+    esp_restart();
+}
+
+// Lets another connection follow an upload while it runs
+static void httpd_get_firmware(http_client_t *client)
+{
+    char response[96];
+    size_t response_len;
+
+    response_len = bbl_snprintf(response, sizeof(response),
+        "{\"state\": \"%s\", \"received\": %u, \"total\": %u}",
+        httpd_upload.state,
+        (unsigned int)httpd_upload.received,
+        (unsigned int)httpd_upload.total
+    );
+
+    httpd_respond(client, "200 OK", "application/json", "Cache-Control: no-store\r\n", response, response_len);
+}
+
 static void httpd_404(http_client_t *client)
 {
-    write(client->sock, BBL_STRING_LITERAL_PARAM(
-        "HTTP/1.1 404 Not Found\r\n"
-        "Connection: Close\r\n"
-        "Content-Type: text/plain\r\n"
-        "\r\n"
-        "Not Found"
-    ));
+    httpd_respond(client, "404 Not Found", "text/plain", "", BBL_STRING_LITERAL_PARAM("Not Found"));
+}
+
+static void httpd_write_chunk(void *ctx, const char *data, size_t len)
+{
+    http_client_t *client = ctx;
+    char size[12];
+    size_t size_len = bbl_snprintf(size, sizeof(size), "%x\r\n", (unsigned int)len);
+
+    // Once one write fails the connection is closed, and the rest fail straight away
+    if (httpd_write_all(client, size, size_len) && httpd_write_all(client, data, len)) {
+        httpd_write_all(client, BBL_STRING_LITERAL_PARAM("\r\n"));
+    }
+}
+
+// Streamed as it is collected, so its length isn't known up front
+static void httpd_get_metrics(http_client_t *client)
+{
+    char header[160];
+    char buf[HTTPD_METRICS_CHUNK];
+    bbl_metrics_t metrics;
+
+    size_t header_len = bbl_snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Cache-Control: no-store\r\n"
+        "%s"
+        "\r\n",
+        client->keep_alive ? "" : "Connection: close\r\n"
+    );
+    if (!httpd_write_all(client, header, header_len)) {
+        return;
+    }
+
+    bbl_metrics_init(&metrics, buf, sizeof(buf), httpd_write_chunk, client);
+    bbl_metrics_collect(&metrics);
+    bbl_metrics_finish(&metrics);
+
+    httpd_write_all(client, BBL_STRING_LITERAL_PARAM("0\r\n\r\n"));
 }
 
 static bool httpd_check_url(http_client_t *client, const char *url)
@@ -467,7 +946,16 @@ static bool httpd_check_url(http_client_t *client, const char *url)
 
 static void httpd_route_request(http_client_t *client)
 {
-    if (httpd_check_url(client, "/") && client->parser.method == HTTP_GET) {
+    if (client->upload) {
+        // The path was checked before the body started streaming, and is gone from the buffer now
+        httpd_post_firmware(client);
+    } else if (!httpd_config_mode) {
+        if (httpd_check_url(client, "/metrics") && client->parser.method == HTTP_GET) {
+            httpd_get_metrics(client);
+        } else {
+            httpd_404(client);
+        }
+    } else if (httpd_check_url(client, "/") && client->parser.method == HTTP_GET) {
         httpd_get_index(client);
     } else if (httpd_check_url(client, "/config")) {
         if (client->parser.method == HTTP_GET) {
@@ -483,18 +971,158 @@ static void httpd_route_request(http_client_t *client)
         httpd_update_check(client);
     } else if (httpd_check_url(client, "/downloadupdate") && client->parser.method == HTTP_GET) {
         httpd_download_update(client);
+    } else if (httpd_check_url(client, "/firmware") && client->parser.method == HTTP_GET) {
+        httpd_get_firmware(client);
     } else {
         httpd_404(client);
     }
 }
 
+// Safe to call again on a client already closed, e.g. by a failed write
+static void httpd_close_client(http_client_t *client)
+{
+    if (client->sock == -1) {
+        return;
+    }
+
+    if (httpd_upload.client == client) {
+        BBL_LOG("Firmware upload dropped after %u bytes", (unsigned int)httpd_upload.received);
+        httpd_upload_abort();
+    }
+
+    close(client->sock);
+    client->sock = -1;
+}
+
+static void httpd_accept(http_client_t *clients, int httpd_sock)
+{
+    int client_sock = accept(httpd_sock, NULL, NULL);
+
+    if (client_sock < 0) {
+        return;
+    }
+
+    for (int i = 0; i < httpd_client_count; ++i) {
+        http_client_t *client = &clients[i];
+
+        if (client->sock == -1) {
+            struct timeval tv = { HTTPD_SEND_TIMEOUT_MS / 1000, HTTPD_SEND_TIMEOUT_MS % 1000 * 1000 };
+
+            setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            // Headers and body go out in separate writes; with Nagle the body waits on the
+            // client's delayed ACK of the headers
+            int opt = 1;
+            setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            httpd_client_init(client, client_sock);
+            return;
+        }
+    }
+
+    // Only listening while a slot is free, so this shouldn't happen
+    close(client_sock);
+}
+
+// Multiplexes every client over one select() so a slow one only holds up its own slot.  Returns
+// when the listening socket fails.
+static void httpd_serve(http_client_t *clients, int httpd_sock)
+{
+    for (;;) {
+        fd_set readfds;
+        int max_fd = -1;
+        bool slot_free = false;
+        uint32_t now = bbl_millis();
+        struct timeval tv = { HTTPD_SELECT_MS / 1000, HTTPD_SELECT_MS % 1000 * 1000 };
+
+        FD_ZERO(&readfds);
+        for (int i = 0; i < httpd_client_count; ++i) {
+            http_client_t *client = &clients[i];
+
+            if (client->sock != -1 && now - client->last_active >= BBL_HTTPD_IDLE_MS) {
+                httpd_close_client(client);
+            }
+
+            if (client->sock == -1) {
+                slot_free = true;
+                continue;
+            }
+
+            FD_SET(client->sock, &readfds);
+            max_fd = (client->sock > max_fd) ? client->sock : max_fd;
+        }
+
+        if (slot_free) {
+            FD_SET(httpd_sock, &readfds);
+            max_fd = (httpd_sock > max_fd) ? httpd_sock : max_fd;
+        }
+
+        if (select(max_fd + 1, &readfds, NULL, NULL, &tv) < 0) {
+            return;
+        }
+
+        for (int i = 0; i < httpd_client_count; ++i) {
+            http_client_t *client = &clients[i];
+
+            if (client->sock == -1 || !FD_ISSET(client->sock, &readfds)) {
+                continue;
+            }
+
+            if (!httpd_client_read(client)) {
+                httpd_close_client(client);
+                continue;
+            }
+
+            // One read may hold several pipelined requests; answer them in order
+            while (client->sock != -1 && client->parsing_complete) {
+                httpd_route_request(client);
+
+                if (!client->keep_alive) {
+                    httpd_close_client(client);
+                    break;
+                }
+
+                httpd_client_reset(client);
+                if (!httpd_client_parse(client)) {
+                    httpd_close_client(client);
+                    break;
+                }
+            }
+        }
+
+        if (slot_free && FD_ISSET(httpd_sock, &readfds)) {
+            httpd_accept(clients, httpd_sock);
+        }
+    }
+}
+
 static void httpd_task_thread()
 {
     int httpd_sock = -1;
-    int client_sock;
-    http_client_t *client = malloc(sizeof(http_client_t));
+    int wanted = httpd_client_count;
+    http_client_t *clients = NULL;
     struct sockaddr_in sock_addr;
 
+    // Fewer slots beat no server at all when the heap is tight
+    while (httpd_client_count > 0 && (clients = malloc(httpd_client_count * (sizeof(http_client_t) + httpd_buf_size))) == NULL) {
+        --httpd_client_count;
+    }
+
+    if (clients == NULL) {
+        BBL_LOG("No memory for any HTTP client slots, not serving");
+        vTaskDelete(NULL);
+        return;
+    }
+
+    if (httpd_client_count < wanted) {
+        BBL_LOG("Only had memory for %d of %d HTTP client slots", httpd_client_count, wanted);
+    }
+
+    // Each slot's request buffer follows the slots
+    for (int i = 0; i < httpd_client_count; ++i) {
+        clients[i].sock = -1;
+        clients[i].buf = (char *)&clients[httpd_client_count] + i * httpd_buf_size;
+        clients[i].buf_size = httpd_buf_size;
+    }
+
     for (;;) {
         if (httpd_sock != -1) {
             close(httpd_sock);
@@ -519,24 +1147,28 @@ static void httpd_task_thread()
             continue;
         }
 
-        while ((client_sock = accept(httpd_sock, NULL, NULL)) >= 0) {
-            httpd_client_init(client, client_sock);
-            httpd_read_headers(client);
+        httpd_serve(clients, httpd_sock);
 
-            if (client->headers_complete) {
-                httpd_route_request(client);
+        for (int i = 0; i < httpd_client_count; ++i) {
+            if (clients[i].sock != -1) {
+                httpd_close_client(&clients[i]);
             }
-
-            close(client->sock);
         }
     }
 
-    free(client);
+    free(clients);
 
     vTaskDelete(NULL);
 }
 
-void bbl_httpd_init()
+void bbl_httpd_init(bool config_mode)
 {
-    xTaskCreate(httpd_task_thread, "httpd", 8192, NULL, 5, NULL);
+    TaskHandle_t httpd_task;
+
+    httpd_config_mode = config_mode;
+    httpd_client_count = config_mode ? BBL_HTTPD_CLIENTS : BBL_HTTPD_METRICS_CLIENTS;
+    httpd_buf_size = config_mode ? HTTP_BUFSIZ : BBL_HTTPD_METRICS_BUFSIZ;
+
+    xTaskCreate(httpd_task_thread, "httpd", config_mode ? 8192 : BBL_HTTPD_METRICS_STACK, NULL, 5, &httpd_task);
+    bbl_metrics_add_task(httpd_task);
 }
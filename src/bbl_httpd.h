@@ -3,6 +3,9 @@
 #ifndef __9e96c83f_8309_4071_ad32_3bec802ea653__
 #define __9e96c83f_8309_4071_ad32_3bec802ea653__
 
-void bbl_httpd_init();
+#include <stdbool.h>
+
+// Serves the configuration UI in config mode, and only /metrics otherwise
+void bbl_httpd_init(bool config_mode);
 
 #endif
@@ -2,4 +2,6 @@
 #include "bbl_utils.h"
 
 BBL_INCLUDE_RESOURCE(index, "res/index.html");
+// Written by bump_version.py
+BBL_INCLUDE_RESOURCE(index_gz, "res/index.html.gz");
 BBL_INCLUDE_RESOURCE(favicon, "res/bubbles.png");
@@ -2,6 +2,7 @@
 #define __db7b26d6_dbbb_42b1_a0c2_62bfde2668ca__
 
 BBL_DECLARE_RESOURCE(index);
+BBL_DECLARE_RESOURCE(index_gz);
 BBL_DECLARE_RESOURCE(favicon);
 
 #define BBL_HTTPD_RESOURCES_HASH "c5b2a70e5a05b2157edaf3cf615ef7a119252a06"
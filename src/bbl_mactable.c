@@ -0,0 +1,72 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_mactable.h"
+#include "bbl_utils.h"
+
+#include <string.h>
+
+static size_t mactable_hash(const bbl_mactable_t *table, const uint8_t *mac)
+{
+    return bbl_fnv1a(mac, 6) & table->mask;
+}
+
+static size_t mactable_probe(const bbl_mactable_t *table, const uint8_t *mac)
+{
+    size_t i = mactable_hash(table, mac);
+
+    while (table->slots[i].value != BBL_MACTABLE_EMPTY &&
+        memcmp(table->slots[i].mac, mac, sizeof(table->slots[i].mac)) != 0)
+    {
+        i = (i + 1) & table->mask;
+    }
+
+    return i;
+}
+
+void bbl_mactable_init(bbl_mactable_t *table, bbl_mactable_slot_t *slots, size_t slot_count)
+{
+    table->slots = slots;
+    table->mask = slot_count - 1;
+    bbl_mactable_clear(table);
+}
+
+void bbl_mactable_clear(bbl_mactable_t *table)
+{
+    for (size_t i = 0; i <= table->mask; ++i) {
+        table->slots[i].value = BBL_MACTABLE_EMPTY;
+    }
+}
+
+uint16_t bbl_mactable_find(const bbl_mactable_t *table, const uint8_t *mac)
+{
+    return table->slots[mactable_probe(table, mac)].value;
+}
+
+void bbl_mactable_insert(bbl_mactable_t *table, const uint8_t *mac, uint16_t value)
+{
+    bbl_mactable_slot_t *slot = &table->slots[mactable_probe(table, mac)];
+
+    memcpy(slot->mac, mac, sizeof(slot->mac));
+    slot->value = value;
+}
+
+void bbl_mactable_remove(bbl_mactable_t *table, const uint8_t *mac)
+{
+    size_t i = mactable_probe(table, mac);
+
+    if (table->slots[i].value == BBL_MACTABLE_EMPTY) {
+        return;
+    }
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    for (size_t j = (i + 1) & table->mask; table->slots[j].value != BBL_MACTABLE_EMPTY; j = (j + 1) & table->mask) {
+        size_t home = mactable_hash(table, table->slots[j].mac);
+
+        if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+
+    table->slots[i].value = BBL_MACTABLE_EMPTY;
+}
@@ -0,0 +1,34 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __b019f6f9_9755_4aec_8848_8695e8f9258f__
+#define __b019f6f9_9755_4aec_8848_8695e8f9258f__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Open-addressed (linear probing) index from a 6-byte MAC to a caller-owned
+// entry index.  Slot storage is provided by the caller and the slot count must
+// be a power of two; keep it at least twice the number of live entries.
+
+#define BBL_MACTABLE_EMPTY UINT16_MAX
+
+typedef struct bbl_mactable bbl_mactable_t;
+typedef struct bbl_mactable_slot bbl_mactable_slot_t;
+
+struct bbl_mactable_slot {
+    uint8_t mac[6];
+    uint16_t value;
+};
+
+struct bbl_mactable {
+    bbl_mactable_slot_t *slots;
+    size_t mask;
+};
+
+void bbl_mactable_init(bbl_mactable_t *table, bbl_mactable_slot_t *slots, size_t slot_count);
+void bbl_mactable_clear(bbl_mactable_t *table);
+uint16_t bbl_mactable_find(const bbl_mactable_t *table, const uint8_t *mac);
+void bbl_mactable_insert(bbl_mactable_t *table, const uint8_t *mac, uint16_t value);
+void bbl_mactable_remove(bbl_mactable_t *table, const uint8_t *mac);
+
+#endif
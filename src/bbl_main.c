@@ -4,7 +4,10 @@
 #include <esp_log.h>
 #include <esp_task_wdt.h>
 
+#include "bbl_command.h"
 #include "bbl_config.h"
+#include "bbl_httpd.h"
+#include "bbl_metrics.h"
 #include "bbl_mqtt.h"
 #include "bbl_wifi.h"
 #include "bbl_version.h"
@@ -88,7 +91,10 @@ static void io_init()
     gpio_pad_select_gpio(LED_GPIO);
     gpio_set_direction(LED_GPIO, GPIO_MODE_OUTPUT);
 
-    xTaskCreate(button_task_thread, "button", 2048, NULL, 5, NULL);
+    TaskHandle_t button_task;
+
+    xTaskCreate(button_task_thread, "button", 2048, NULL, 5, &button_task);
+    bbl_metrics_add_task(button_task);
 }
 
 void app_main()
@@ -114,7 +120,7 @@ void app_main()
     io_init();
     bbl_wifi_init();
     if (boot_mode == BootModeConfig) {
-        bbl_httpd_init();
+        bbl_httpd_init(true);
 
         for (int i = 0; i < 3; ++i) {
             gpio_set_level(LED_GPIO, 1);
@@ -123,7 +129,10 @@ void app_main()
             bbl_sleep(300);
         }
     } else {
+        bbl_mqtt_init();
         bbl_ble_init();
+        bbl_command_init();
+        bbl_httpd_init(false);
 
         gpio_set_level(LED_GPIO, 1);
         bbl_sleep(2000);
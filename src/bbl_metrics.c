@@ -0,0 +1,167 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_metrics.h"
+#include "bbl_ble.h"
+#include "bbl_mqtt.h"
+#include "bbl_spool.h"
+#include "bbl_utils.h"
+
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <string.h>
+
+#define METRICS_LINE_SIZE 160
+
+static TaskHandle_t metrics_tasks[BBL_METRICS_TASKS];
+static uint32_t metrics_task_count;
+
+static void metrics_write(bbl_metrics_t *metrics, const char *line, size_t len)
+{
+    if (metrics->used + len >= metrics->size) {
+        bbl_metrics_finish(metrics);
+    }
+
+    if (metrics->overflow || metrics->used + len >= metrics->size) {
+        metrics->overflow = true;
+        return;
+    }
+
+    memcpy(metrics->buf + metrics->used, line, len);
+    metrics->used += len;
+    metrics->buf[metrics->used] = 0;
+}
+
+void bbl_metrics_init(bbl_metrics_t *metrics, char *buf, size_t size, bbl_metrics_flush_t flush, void *ctx)
+{
+    metrics->buf = buf;
+    metrics->size = size;
+    metrics->used = 0;
+    metrics->overflow = false;
+    metrics->flush = flush;
+    metrics->ctx = ctx;
+}
+
+void bbl_metrics_finish(bbl_metrics_t *metrics)
+{
+    if (metrics->flush == NULL || metrics->used == 0) {
+        return;
+    }
+
+    metrics->flush(metrics->ctx, metrics->buf, metrics->used);
+    metrics->used = 0;
+}
+
+void bbl_metrics_family(bbl_metrics_t *metrics, const char *name, const char *type)
+{
+    char line[METRICS_LINE_SIZE];
+    size_t len = bbl_snprintf(line, sizeof(line), "# TYPE %s %s\n", name, type);
+
+    metrics_write(metrics, line, len);
+}
+
+void bbl_metrics_sample(bbl_metrics_t *metrics, const char *name, const char *labels, int64_t value)
+{
+    char line[METRICS_LINE_SIZE];
+    size_t len = bbl_snprintf(line, sizeof(line), "%s%s%s%s %lld\n",
+        name,
+        labels ? "{" : "",
+        labels ? labels : "",
+        labels ? "}" : "",
+        (long long)value
+    );
+
+    metrics_write(metrics, line, len);
+}
+
+void bbl_metrics_counter(bbl_metrics_t *metrics, const char *name, int64_t value)
+{
+    bbl_metrics_family(metrics, name, "counter");
+    bbl_metrics_sample(metrics, name, NULL, value);
+}
+
+void bbl_metrics_gauge(bbl_metrics_t *metrics, const char *name, int64_t value)
+{
+    bbl_metrics_family(metrics, name, "gauge");
+    bbl_metrics_sample(metrics, name, NULL, value);
+}
+
+void bbl_metrics_add_task(TaskHandle_t task)
+{
+    uint32_t count = metrics_task_count;
+
+    if (task == NULL || count == BBL_METRICS_TASKS) {
+        return;
+    }
+
+    // The HTTP task may be reading the list already
+    metrics_tasks[count] = task;
+    __atomic_store_n(&metrics_task_count, count + 1, __ATOMIC_RELEASE);
+}
+
+static void metrics_collect_system(bbl_metrics_t *metrics)
+{
+    wifi_ap_record_t ap_info;
+    uint32_t task_count = __atomic_load_n(&metrics_task_count, __ATOMIC_ACQUIRE);
+
+    bbl_metrics_gauge(metrics, "bbl_uptime_seconds", esp_timer_get_time() / 1000000);
+    bbl_metrics_gauge(metrics, "bbl_heap_free_bytes", esp_get_free_heap_size());
+    bbl_metrics_gauge(metrics, "bbl_heap_min_free_bytes", esp_get_minimum_free_heap_size());
+
+    // Least stack each task has had left, in bytes on this port
+    bbl_metrics_family(metrics, "bbl_task_stack_min_free_bytes", "gauge");
+    for (uint32_t i = 0; i < task_count; ++i) {
+        char labels[32];
+
+        bbl_snprintf(labels, sizeof(labels), "task=\"%s\"", pcTaskGetTaskName(metrics_tasks[i]));
+        bbl_metrics_sample(metrics, "bbl_task_stack_min_free_bytes", labels, uxTaskGetStackHighWaterMark(metrics_tasks[i]));
+    }
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        bbl_metrics_gauge(metrics, "bbl_wifi_rssi_dbm", ap_info.rssi);
+    }
+}
+
+static void metrics_collect_mqtt(bbl_metrics_t *metrics)
+{
+    bbl_mqtt_stats_t stats;
+
+    bbl_mqtt_stats(&stats);
+    bbl_metrics_gauge(metrics, "bbl_mqtt_connected", bbl_mqtt_connected());
+    bbl_metrics_counter(metrics, "bbl_mqtt_publishes_total", stats.publishes);
+    bbl_metrics_counter(metrics, "bbl_mqtt_dropped_total", stats.dropped);
+    bbl_metrics_counter(metrics, "bbl_mqtt_written_bytes_total", stats.bytes_written);
+    bbl_metrics_counter(metrics, "bbl_mqtt_connects_total", stats.connects);
+    bbl_metrics_counter(metrics, "bbl_mqtt_connect_failures_total", stats.connect_failures);
+    bbl_metrics_counter(metrics, "bbl_mqtt_disconnects_total", stats.disconnects);
+    bbl_metrics_counter(metrics, "bbl_mqtt_ping_timeouts_total", stats.ping_timeouts);
+    bbl_metrics_gauge(metrics, "bbl_mqtt_ping_rtt_ms", stats.ping_rtt_ms);
+    bbl_metrics_counter(metrics, "bbl_mqtt_acked_total", stats.acked);
+    bbl_metrics_counter(metrics, "bbl_mqtt_retransmits_total", stats.retransmits);
+    bbl_metrics_gauge(metrics, "bbl_mqtt_inflight", stats.inflight);
+    bbl_metrics_gauge(metrics, "bbl_mqtt_queue_free_bytes", stats.queue_free);
+    bbl_metrics_counter(metrics, "bbl_mqtt_received_total", stats.received);
+    bbl_metrics_counter(metrics, "bbl_mqtt_rx_dropped_total", stats.rx_dropped);
+    bbl_metrics_counter(metrics, "bbl_tls_handshakes_total", stats.tls_handshakes);
+    bbl_metrics_counter(metrics, "bbl_tls_resumed_total", stats.tls_resumed);
+}
+
+static void metrics_collect_spool(bbl_metrics_t *metrics)
+{
+    const bbl_spool_stats_t *stats = bbl_spool_stats();
+
+    bbl_metrics_gauge(metrics, "bbl_spool_depth", stats->depth);
+    bbl_metrics_counter(metrics, "bbl_spool_spooled_total", stats->spooled);
+    bbl_metrics_counter(metrics, "bbl_spool_replayed_total", stats->replayed);
+    bbl_metrics_counter(metrics, "bbl_spool_dropped_total", stats->dropped);
+    bbl_metrics_counter(metrics, "bbl_spool_oversized_total", stats->oversized);
+    bbl_metrics_gauge(metrics, "bbl_spool_lag_ms", stats->lag_ms);
+}
+
+void bbl_metrics_collect(bbl_metrics_t *metrics)
+{
+    metrics_collect_system(metrics);
+    metrics_collect_mqtt(metrics);
+    metrics_collect_spool(metrics);
+    bbl_ble_metrics(metrics);
+}
@@ -0,0 +1,51 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __2d40ba1e_99ee_459c_a32c_a9789a2c1111__
+#define __2d40ba1e_99ee_459c_a32c_a9789a2c1111__
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Operational counters in the Prometheus text exposition format, for scraping over HTTP when
+// MQTT itself is what's broken.  Output collects in the caller's buffer and is handed to flush
+// each time the buffer fills, so the whole exposition never has to be in memory at once.  Without
+// flush, output past the end of the buffer is dropped and flagged in overflow, like the CBOR writer.
+
+#ifndef BBL_METRICS_TASKS
+    #define BBL_METRICS_TASKS 8
+#endif
+
+typedef struct bbl_metrics bbl_metrics_t;
+
+typedef void (*bbl_metrics_flush_t)(void *ctx, const char *data, size_t len);
+
+struct bbl_metrics {
+    char *buf;
+    size_t size;
+    size_t used;
+    bool overflow;
+    bbl_metrics_flush_t flush;
+    void *ctx;
+};
+
+// flush may be NULL to keep everything in buf
+void bbl_metrics_init(bbl_metrics_t *metrics, char *buf, size_t size, bbl_metrics_flush_t flush, void *ctx);
+// Hands whatever is left in the buffer to flush
+void bbl_metrics_finish(bbl_metrics_t *metrics);
+// Starts a family; the samples that follow up to the next family belong to it
+void bbl_metrics_family(bbl_metrics_t *metrics, const char *name, const char *type);
+// labels is NULL or the inside of the braces, e.g. type="raw"
+void bbl_metrics_sample(bbl_metrics_t *metrics, const char *name, const char *labels, int64_t value);
+void bbl_metrics_counter(bbl_metrics_t *metrics, const char *name, int64_t value);
+void bbl_metrics_gauge(bbl_metrics_t *metrics, const char *name, int64_t value);
+
+// Tasks whose stack high-water marks are reported.  Meant to be called as tasks are created at
+// startup, from one task.
+void bbl_metrics_add_task(TaskHandle_t task);
+// Everything the firmware reports: system, MQTT, spool and BLE
+void bbl_metrics_collect(bbl_metrics_t *metrics);
+
+#endif
@@ -4,10 +4,69 @@
 #include "bbl_config.h"
 #include "bbl_wifi.h"
 #include "bbl_utils.h"
+#include "bbl_log.h"
+#include "bbl_metrics.h"
+#include "bbl_tcp.h"
+#include "bbl_tls.h"
 
-#include <esp_tls.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/ringbuf.h>
+#include <esp_system.h>
+#include <lwip/sockets.h>
+
+// Outgoing packets are coalesced here so a run of PUBLISHes goes out as one TLS record.
+// Must hold the largest message we publish, a full report batch.
+#ifndef BBL_MQTT_OUTBUF_SIZE
+    #define BBL_MQTT_OUTBUF_SIZE 4608
+#endif
+// Longest a partially filled output buffer waits for more packets
+#ifndef BBL_MQTT_LINGER_MS
+    #define BBL_MQTT_LINGER_MS 20
+#endif
+// Bytes of messages queued for the client task, including their headers
+#ifndef BBL_MQTT_QUEUE_SIZE
+    #define BBL_MQTT_QUEUE_SIZE 16384
+#endif
+// Most QoS 1 messages awaiting a PUBACK at once; the configured window can only be smaller
+#ifndef BBL_MQTT_INFLIGHT_MAX
+    #define BBL_MQTT_INFLIGHT_MAX 32
+#endif
+// Received bytes waiting to be parsed; must be a power of two
+#ifndef BBL_MQTT_INBUF_SIZE
+    #define BBL_MQTT_INBUF_SIZE 1024
+#endif
+// Topics with an inbound PUBLISH handler
+#ifndef BBL_MQTT_HANDLERS
+    #define BBL_MQTT_HANDLERS 4
+#endif
+// Topic aliases we will use when the broker allows them (MQTT 5 only)
+#ifndef BBL_MQTT_TOPIC_ALIASES
+    #define BBL_MQTT_TOPIC_ALIASES 64
+#endif
+// Longer topics are always sent in full
+#define MQTT_ALIAS_TOPIC_MAX 96
+#define MQTT_HANDLER_TOPIC_MAX 96
+// Start of an inbound packet gathered before it is handled: all of a control packet we care
+// about, or the variable header of a PUBLISH
+#define MQTT_RX_HEAD_SIZE 256
+// Fixed header, topic length, packet id and the Topic Alias property
+#define MQTT_MAX_MESSAGE (BBL_MQTT_OUTBUF_SIZE - 5 - 2 - 2 - 4)
+#define MQTT_POLL_MS BBL_MQTT_LINGER_MS
+#define MQTT_CONNACK_TIMEOUT_MS 10000
+#define MQTT_BACKOFF_MIN_MS 1000
+#define MQTT_BACKOFF_MAX_MS 60000
+// Longest we wait for a PINGRESP before declaring the link dead
+#define MQTT_PING_TIMEOUT_MS 5000
 
 typedef enum mqtt_packetid mqtt_packetid_t;
+typedef enum mqtt_state mqtt_state_t;
+typedef enum mqtt_rx_state mqtt_rx_state_t;
+typedef struct mqtt_msg mqtt_msg_t;
+typedef struct mqtt_inflight mqtt_inflight_t;
+typedef struct mqtt_alias mqtt_alias_t;
+typedef struct mqtt_handler mqtt_handler_t;
 
 enum mqtt_packetid {
     MQTT_FORBIDDEN   = 0x00,
@@ -28,12 +87,114 @@ enum mqtt_packetid {
     MQTT_RESERVED    = 0xf0,
 };
 
-static esp_tls_t *mqtt_conn = NULL;
-static bool mqtt_conn_error = false;
-static bool mqtt_connack_received = false;
-static uint8_t mqtt_buf[512];
-static size_t mqtt_buf_used;
-static size_t mqtt_skip;
+#define MQTT_PUBLISH_DUP  0x08
+#define MQTT_PUBLISH_QOS1 0x02
+
+// MQTT 5 properties we use
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM 0x22
+#define MQTT_PROP_TOPIC_ALIAS         0x23
+
+enum mqtt_state {
+    MqttStateIdle,          // Waiting for Wi-Fi before connecting
+    MqttStateConnecting,    // CONNECT sent, waiting for CONNACK
+    MqttStateConnected,
+    MqttStateBackoff,       // Waiting out the delay after a failed connection
+};
+
+enum mqtt_rx_state {
+    MqttRxType,             // Fixed header byte
+    MqttRxLength,           // Remaining length
+    MqttRxHead,             // Gathering the start of the body into mqtt_rx_head
+    MqttRxPayload,          // Streaming a PUBLISH payload to its handler
+    MqttRxSkip,             // Discarding the rest of the packet
+};
+
+// Queued for the client task, followed by the topic and payload
+struct mqtt_msg {
+    uint16_t topic_len;
+    uint16_t payload_len;
+};
+
+// A QoS 1 message sent but not yet acknowledged.  The message itself stays in the queue until
+// its PUBACK arrives, so it can be sent again after a reconnect.
+struct mqtt_inflight {
+    mqtt_msg_t *msg;
+    uint16_t packet_id;
+    bool acked;
+    uint32_t sent_millis;
+};
+
+// Topic alias N is kept in slot N - 1
+struct mqtt_alias {
+    uint32_t hash;
+    uint32_t last_used;
+    uint16_t topic_len;
+    bool established;           // The broker has seen this alias with its topic
+    char topic[MQTT_ALIAS_TOPIC_MAX];
+};
+
+struct mqtt_handler {
+    char topic[MQTT_HANDLER_TOPIC_MAX];
+    bbl_mqtt_handler_t handler;
+};
+
+static bbl_transport_t *mqtt_conn = NULL;
+static mqtt_state_t mqtt_state;
+static uint32_t mqtt_state_millis;
+static uint32_t mqtt_backoff_ms = MQTT_BACKOFF_MIN_MS;
+static TaskHandle_t mqtt_task;
+static RingbufHandle_t mqtt_queue;
+static SemaphoreHandle_t mqtt_queue_lock;
+static uint8_t mqtt_queue_scratch[sizeof(mqtt_msg_t) + MQTT_MAX_MESSAGE];
+static mqtt_msg_t *mqtt_pending;
+static size_t mqtt_pending_size;
+static volatile bool mqtt_flush_requested;
+// Free-running offsets into mqtt_in; parsing never moves bytes already received
+static uint8_t mqtt_in[BBL_MQTT_INBUF_SIZE];
+static size_t mqtt_in_head;
+static size_t mqtt_in_tail;
+static mqtt_rx_state_t mqtt_rx_state;
+static uint8_t mqtt_rx_type;
+static size_t mqtt_rx_len;
+static size_t mqtt_rx_len_bytes;
+static size_t mqtt_rx_left;         // Body bytes not consumed yet
+static uint8_t mqtt_rx_head[MQTT_RX_HEAD_SIZE];
+static size_t mqtt_rx_head_used;
+static char mqtt_rx_topic[MQTT_RX_HEAD_SIZE];
+static bbl_mqtt_handler_t mqtt_rx_handler;
+static size_t mqtt_rx_offset;
+static size_t mqtt_rx_total;
+static mqtt_handler_t mqtt_handlers[BBL_MQTT_HANDLERS];
+static volatile size_t mqtt_handler_count;
+static bool mqtt_subscribe_pending;
+static uint8_t mqtt_out[BBL_MQTT_OUTBUF_SIZE];
+static size_t mqtt_out_used;
+static size_t mqtt_out_sent;
+static bool mqtt_out_sending;
+static bool mqtt_out_more;          // More is queued behind a full buffer
+static uint32_t mqtt_out_started;
+// Only the client task updates mqtt_stats; other tasks read the snapshot it takes under
+// mqtt_queue_lock once per pass, so the counters they see agree with each other
+static bbl_mqtt_stats_t mqtt_stats;
+static bbl_mqtt_stats_t mqtt_stats_snapshot;
+static uint32_t mqtt_dropped;       // Under mqtt_queue_lock, bbl_mqtt_publish() runs on any task
+static uint32_t mqtt_keepalive_ms;
+static uint32_t mqtt_last_sent;
+static uint32_t mqtt_last_received;
+static uint32_t mqtt_ping_sent;
+static bool mqtt_ping_outstanding;
+static uint8_t mqtt_qos;
+static size_t mqtt_window;
+static uint16_t mqtt_packet_id;
+// Ordered oldest first; acked entries are only retired from the head
+static mqtt_inflight_t mqtt_inflight[BBL_MQTT_INFLIGHT_MAX];
+static size_t mqtt_inflight_head;
+static size_t mqtt_inflight_count;
+static size_t mqtt_resend_next;
+static bool mqtt_v5;
+static mqtt_alias_t mqtt_aliases[BBL_MQTT_TOPIC_ALIASES];
+static size_t mqtt_alias_count;
+static uint32_t mqtt_alias_clock;
 
 static size_t mqtt_encode_len(uint8_t *buf, size_t len)
 {
@@ -62,79 +223,431 @@ static size_t mqtt_decode_len(const uint8_t *buf, size_t *len)
     return count;
 }
 
-static bool mqtt_writev(const struct iovec *iov, int iovcnt)
+static void mqtt_set_state(mqtt_state_t state)
 {
-    int iov_written = 0;
+    mqtt_state = state;
+    mqtt_state_millis = bbl_millis();
+}
 
-    for (int i = 0; i < iovcnt; ) {
-        const int to_write = iov[i].iov_len - iov_written;
-        int result = esp_tls_conn_write(mqtt_conn, iov[i].iov_base + iov_written, to_write);
+static void mqtt_close()
+{
+    bbl_transport_close(mqtt_conn);
+    mqtt_conn = NULL;
+    mqtt_in_head = 0;
+    mqtt_in_tail = 0;
+    mqtt_rx_state = MqttRxType;
+    mqtt_out_used = 0;
+    mqtt_out_sent = 0;
+    mqtt_out_sending = false;
+    mqtt_out_more = false;
+    // Everything still unacknowledged goes out again on the next connection
+    mqtt_resend_next = 0;
+}
+
+static void mqtt_fail(const char *reason)
+{
+    BBL_LOG("MQTT connection failed (%s), retrying in %u ms", reason, mqtt_backoff_ms);
+
+    // Anything before the CONNACK is a failure to connect, after it the session was lost
+    if (mqtt_state == MqttStateConnected) {
+        ++mqtt_stats.disconnects;
+    } else {
+        ++mqtt_stats.connect_failures;
+    }
+
+    mqtt_close();
+    mqtt_set_state(MqttStateBackoff);
+}
+
+// Sends as much of the output buffer as the socket will take without blocking.  Once started,
+// the buffer is frozen until it has all gone out, since a TLS write that would have blocked has
+// to be retried with the same data.
+static bool mqtt_send()
+{
+    mqtt_out_sending = true;
+
+    while (mqtt_out_sent < mqtt_out_used) {
+        int result = bbl_transport_write(mqtt_conn, mqtt_out + mqtt_out_sent, mqtt_out_used - mqtt_out_sent, mqtt_out_more);
 
         if (result >= 0) {
-            iov_written += result;
-            if (iov_written == iov[i].iov_len) {
-                iov_written = 0;
-                ++i;
-            }
-        } else if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            mqtt_conn_error = true;
-            bbl_mqtt_disconnect();
+            mqtt_last_sent = bbl_millis();
+            mqtt_out_sent += result;
+            ++mqtt_stats.writes;
+            mqtt_stats.bytes_written += result;
+        } else if (result == BBL_TRANSPORT_WOULD_BLOCK) {
+            return true;
+        } else {
+            mqtt_fail("write");
             return false;
         }
     }
 
+    mqtt_out_used = 0;
+    mqtt_out_sent = 0;
+    mqtt_out_sending = false;
+    mqtt_out_more = false;
     return true;
 }
 
-static int mqtt_parse(const uint8_t *buf, size_t len)
+static bool mqtt_writev(const struct iovec *iov, int iovcnt)
 {
-    size_t pktlen = 0;
-    bool length_parsed = false;
+    size_t len = 0;
 
-    size_t idx = 1;
-    for (; idx < len && !length_parsed; ++idx) {
-        pktlen += (buf[idx] & 0x7f) << (7 * (idx - 1));
-        length_parsed = ((buf[idx] & 0x80) == 0 || idx == 4);
+    for (int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
     }
 
-    if (!length_parsed) {
-        return 0;
+    if (mqtt_out_sending || mqtt_out_used + len > sizeof(mqtt_out)) {
+        return false;
     }
 
-    if (pktlen > sizeof(mqtt_buf)) {
-        mqtt_skip = idx + pktlen - len;
-        return len;
+    if (mqtt_out_used == 0) {
+        mqtt_out_started = bbl_millis();
+    }
+
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(mqtt_out + mqtt_out_used, iov[i].iov_base, iov[i].iov_len);
+        mqtt_out_used += iov[i].iov_len;
+    }
+
+    return true;
+}
+
+static mqtt_inflight_t *mqtt_inflight_at(size_t i)
+{
+    return &mqtt_inflight[(mqtt_inflight_head + i) % BBL_MQTT_INFLIGHT_MAX];
+}
+
+static void mqtt_puback(uint16_t packet_id)
+{
+    for (size_t i = 0; i < mqtt_inflight_count; ++i) {
+        mqtt_inflight_t *slot = mqtt_inflight_at(i);
+
+        if (slot->packet_id == packet_id && !slot->acked) {
+            uint32_t rtt = bbl_millis() - slot->sent_millis;
+
+            slot->acked = true;
+            ++mqtt_stats.acked;
+            mqtt_stats.rtt_total_ms += rtt;
+            if (rtt > mqtt_stats.rtt_max_ms) {
+                mqtt_stats.rtt_max_ms = rtt;
+            }
+            break;
+        }
     }
 
-    if (idx + pktlen > len) {
-        return 0;
+    // Acks normally arrive in order, so this usually retires exactly the one just acked
+    while (mqtt_inflight_count > 0 && mqtt_inflight_at(0)->acked) {
+        vRingbufferReturnItem(mqtt_queue, mqtt_inflight_at(0)->msg);
+        mqtt_inflight_head = (mqtt_inflight_head + 1) % BBL_MQTT_INFLIGHT_MAX;
+        --mqtt_inflight_count;
+        if (mqtt_resend_next > 0) {
+            --mqtt_resend_next;
+        }
     }
+}
 
-    switch (buf[0] & 0xf0) {
+// Finds a property in an MQTT 5 property list, returning a pointer to its value or NULL
+static const uint8_t *mqtt_find_property(const uint8_t *props, size_t len, uint8_t wanted)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        uint8_t id = props[pos++];
+        size_t value_len;
+
+        if (id == wanted) {
+            return props + pos;
+        }
+
+        switch (id) {
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2a:
+            value_len = 1;
+            break;
+
+        case 0x13: case 0x21: case 0x22: case 0x23:
+            value_len = 2;
+            break;
+
+        case 0x02: case 0x11: case 0x18: case 0x27:
+            value_len = 4;
+            break;
+
+        case 0x0b: {
+            size_t ignored;
+            value_len = mqtt_decode_len(props + pos, &ignored);
+            break;
+        }
+
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1a: case 0x1c: case 0x1f:
+            value_len = 2 + ((props[pos] << 8) | props[pos + 1]);
+            break;
+
+        case 0x26:
+            value_len = 2 + ((props[pos] << 8) | props[pos + 1]);
+            value_len += 2 + ((props[pos + value_len] << 8) | props[pos + value_len + 1]);
+            break;
+
+        default:
+            return NULL;
+        }
+
+        pos += value_len;
+    }
+
+    return NULL;
+}
+
+static void mqtt_connack(const uint8_t *buf, size_t len)
+{
+    mqtt_alias_count = 0;
+    memset(mqtt_aliases, 0, sizeof(mqtt_aliases));
+
+    if (mqtt_v5 && len > 2) {
+        size_t props_len;
+        size_t props_len_len = mqtt_decode_len(buf + 2, &props_len);
+        const uint8_t *props = buf + 2 + props_len_len;
+
+        if (2 + props_len_len + props_len <= len) {
+            const uint8_t *value = mqtt_find_property(props, props_len, MQTT_PROP_TOPIC_ALIAS_MAXIMUM);
+
+            if (value != NULL) {
+                mqtt_alias_count = (value[0] << 8) | value[1];
+                if (mqtt_alias_count > BBL_MQTT_TOPIC_ALIASES) {
+                    mqtt_alias_count = BBL_MQTT_TOPIC_ALIASES;
+                }
+            }
+        }
+    }
+
+    // Clean sessions forget subscriptions, so they are renewed on every connection
+    mqtt_subscribe_pending = mqtt_handler_count > 0;
+
+    BBL_LOG("MQTT connected, %u topic aliases", (unsigned int)mqtt_alias_count);
+    mqtt_backoff_ms = MQTT_BACKOFF_MIN_MS;
+    mqtt_set_state(MqttStateConnected);
+}
+
+// Handles a control packet, or as much of it as fit in mqtt_rx_head
+static bool mqtt_packet(uint8_t type, const uint8_t *buf, size_t len)
+{
+    switch (type & 0xf0) {
     case MQTT_CONNACK:
-        if (!mqtt_connack_received && pktlen == 2 && buf[idx + 1] == 0) {
-            mqtt_connack_received = true;
+        // The return code (3.1.1) and reason code (5) are both zero on success
+        if (mqtt_state == MqttStateConnecting && len >= 2 && buf[1] == 0) {
+            mqtt_connack(buf, len);
         } else {
-            bbl_mqtt_disconnect();
+            mqtt_fail("connack");
+            return false;
+        }
+        break;
+
+    case MQTT_PUBACK:
+        // MQTT 5 may append a reason code and properties
+        if (len >= 2) {
+            mqtt_puback((buf[0] << 8) | buf[1]);
+        }
+        break;
+
+    case MQTT_SUBACK: {
+        // One return code per topic, after the MQTT 5 properties
+        size_t pos = 2;
+        if (mqtt_v5 && len > pos) {
+            size_t props_len;
+            pos += mqtt_decode_len(buf + pos, &props_len);
+            pos += props_len;
+        }
+
+        for (; pos < len; ++pos) {
+            if (buf[pos] >= 0x80) {
+                BBL_LOG("MQTT subscription refused (0x%02x)", buf[pos]);
+                ++mqtt_stats.sub_failures;
+            }
+        }
+        break;
+    }
+
+    case MQTT_PINGRESP:
+        if (mqtt_ping_outstanding) {
+            mqtt_ping_outstanding = false;
+            mqtt_stats.ping_rtt_ms = bbl_millis() - mqtt_ping_sent;
         }
         break;
     }
 
-    return idx + pktlen;
+    return true;
 }
 
-static void fill_iovec(struct iovec *iov, void *base, size_t len)
+// Length of a PUBLISH variable header, as far as the bytes gathered so far can tell.  Called
+// again as more arrive until it stops growing.
+static size_t mqtt_publish_head_len(uint8_t type, const uint8_t *buf, size_t used)
 {
-    iov->iov_base = base;
-    iov->iov_len = len;
+    if (used < 2) {
+        return 2;
+    }
+
+    size_t len = 2 + ((buf[0] << 8) | buf[1]);
+    if (type & 0x06) {
+        len += 2;
+    }
+
+    if (!mqtt_v5) {
+        return len;
+    }
+
+    size_t props_len = 0;
+    size_t count = 0;
+
+    do {
+        if (used <= len + count) {
+            return len + count + 1;
+        }
+        props_len |= (buf[len + count] & 0x7f) << (7 * count);
+    } while (buf[len + count++] & 0x80 && count < 4);
+
+    return len + count + props_len;
 }
 
-bool bbl_mqtt_connect()
+static size_t mqtt_rx_head_want()
 {
-    if (mqtt_conn != NULL) {
-        return true;
+    if ((mqtt_rx_type & 0xf0) != MQTT_PUBLISH) {
+        return (mqtt_rx_len < sizeof(mqtt_rx_head)) ? mqtt_rx_len : sizeof(mqtt_rx_head);
+    }
+
+    size_t want = mqtt_publish_head_len(mqtt_rx_type, mqtt_rx_head, mqtt_rx_head_used);
+    return (want < mqtt_rx_len) ? want : mqtt_rx_len;
+}
+
+static bool mqtt_rx_dispatch()
+{
+    if ((mqtt_rx_type & 0xf0) != MQTT_PUBLISH) {
+        mqtt_rx_state = (mqtt_rx_left > 0) ? MqttRxSkip : MqttRxType;
+        return mqtt_packet(mqtt_rx_type, mqtt_rx_head, mqtt_rx_head_used);
+    }
+
+    if (mqtt_publish_head_len(mqtt_rx_type, mqtt_rx_head, mqtt_rx_head_used) > mqtt_rx_head_used) {
+        mqtt_fail("publish");
+        return false;
+    }
+
+    size_t topic_len = (mqtt_rx_head[0] << 8) | mqtt_rx_head[1];
+    memcpy(mqtt_rx_topic, mqtt_rx_head + 2, topic_len);
+    mqtt_rx_topic[topic_len] = '\0';
+
+    mqtt_rx_handler = NULL;
+    for (size_t i = 0; i < mqtt_handler_count; ++i) {
+        if (strcmp(mqtt_handlers[i].topic, mqtt_rx_topic) == 0) {
+            mqtt_rx_handler = mqtt_handlers[i].handler;
+            break;
+        }
+    }
+
+    ++mqtt_stats.received;
+    mqtt_rx_offset = 0;
+    mqtt_rx_total = mqtt_rx_left;
+    mqtt_rx_state = MqttRxPayload;
+
+    // Still tell the handler about an empty message
+    if (mqtt_rx_handler != NULL && mqtt_rx_total == 0) {
+        mqtt_rx_handler(mqtt_rx_topic, NULL, 0, 0, 0);
+    }
+
+    return true;
+}
+
+// Consumes everything received so far, one byte or contiguous run at a time, so packets can
+// span the end of mqtt_in and payloads go to their handler straight from it
+static bool mqtt_parse()
+{
+    for (;;) {
+        size_t offset = mqtt_in_tail & (BBL_MQTT_INBUF_SIZE - 1);
+        size_t avail = mqtt_in_head - mqtt_in_tail;
+        size_t contig = (avail < BBL_MQTT_INBUF_SIZE - offset) ? avail : BBL_MQTT_INBUF_SIZE - offset;
+        const uint8_t *data = mqtt_in + offset;
+        size_t take = 0;
+
+        switch (mqtt_rx_state) {
+        case MqttRxType:
+            if (contig == 0) {
+                return true;
+            }
+            mqtt_rx_type = data[0];
+            mqtt_rx_len = 0;
+            mqtt_rx_len_bytes = 0;
+            mqtt_rx_state = MqttRxLength;
+            take = 1;
+            break;
+
+        case MqttRxLength:
+            if (contig == 0) {
+                return true;
+            }
+            mqtt_rx_len |= (data[0] & 0x7f) << (7 * mqtt_rx_len_bytes++);
+            take = 1;
+            if ((data[0] & 0x80) == 0) {
+                mqtt_rx_left = mqtt_rx_len;
+                mqtt_rx_head_used = 0;
+                mqtt_rx_state = MqttRxHead;
+            } else if (mqtt_rx_len_bytes == 4) {
+                mqtt_fail("length");
+                return false;
+            }
+            break;
+
+        case MqttRxHead: {
+            size_t want = mqtt_rx_head_want();
+
+            if (mqtt_rx_head_used >= want) {
+                if (!mqtt_rx_dispatch()) {
+                    return false;
+                }
+            } else if (want > sizeof(mqtt_rx_head)) {
+                // A topic or properties too long to gather; nobody could handle it anyway
+                ++mqtt_stats.rx_dropped;
+                mqtt_rx_state = MqttRxSkip;
+            } else if (contig == 0) {
+                return true;
+            } else {
+                take = want - mqtt_rx_head_used;
+                take = (take < contig) ? take : contig;
+                memcpy(mqtt_rx_head + mqtt_rx_head_used, data, take);
+                mqtt_rx_head_used += take;
+                mqtt_rx_left -= take;
+            }
+            break;
+        }
+
+        case MqttRxPayload:
+        case MqttRxSkip:
+            if (mqtt_rx_left == 0) {
+                mqtt_rx_state = MqttRxType;
+                break;
+            } else if (contig == 0) {
+                return true;
+            }
+
+            take = (mqtt_rx_left < contig) ? mqtt_rx_left : contig;
+            mqtt_rx_left -= take;
+
+            if (mqtt_rx_state == MqttRxPayload && mqtt_rx_handler != NULL) {
+                mqtt_rx_handler(mqtt_rx_topic, data, take, mqtt_rx_offset, mqtt_rx_total);
+            }
+            mqtt_rx_offset += take;
+            break;
+        }
+
+        mqtt_in_tail += take;
     }
+}
+
+static void fill_iovec(struct iovec *iov, const void *base, size_t len)
+{
+    iov->iov_base = (void *)base;
+    iov->iov_len = len;
+}
 
+static void mqtt_open()
+{
     const char *host = bbl_config_get_string(ConfigKeyMQTTHost);
     uint16_t port = (uint16_t)bbl_config_get_int(ConfigKeyMQTTPort);
     bool tls = bbl_config_get_int(ConfigKeyMQTTTLS) != 0;
@@ -142,14 +655,28 @@ bool bbl_mqtt_connect()
     const char *username = bbl_config_get_string(ConfigKeyMQTTUser);
     const char *password = bbl_config_get_string(ConfigKeyMQTTPass);
 
-    xEventGroupWaitBits(bbl_wifi_event_group, BBL_WIFI_CONNECTED_BIT, false, true, portMAX_DELAY);
-
-    esp_tls_cfg_t cfg = {0};
+    // Back off further for every attempt that doesn't end in a CONNACK, with some jitter so
+    // a fleet of nodes that lost the broker together doesn't reconnect in lockstep
+    uint32_t backoff = mqtt_backoff_ms;
+    mqtt_backoff_ms = (backoff * 2 > MQTT_BACKOFF_MAX_MS) ? MQTT_BACKOFF_MAX_MS : backoff * 2;
+    mqtt_backoff_ms += esp_random() % (mqtt_backoff_ms / 4);
 
-    mqtt_conn = esp_tls_conn_new(host, strlen(host), port, tls ? &cfg : NULL);
-    mqtt_conn_error = false;
+    // The TCP connect and TLS handshake still block, but only this task
+    if (tls) {
+        mqtt_conn = bbl_tls_connect(host, port);
+    } else {
+        mqtt_conn = bbl_tcp_connect(host, port, bbl_config_get_int(ConfigKeyNoDelay) != 0);
+    }
     if (mqtt_conn == NULL) {
-        goto err;
+        mqtt_fail("connect");
+        return;
+    }
+
+    ++mqtt_stats.connects;
+    if (tls) {
+        ++mqtt_stats.tls_handshakes;
+        mqtt_stats.tls_resumed += bbl_tls_resumed(mqtt_conn);
+        mqtt_stats.tls_handshake_ms = bbl_tls_handshake_ms(mqtt_conn);
     }
 
     uint8_t header[5];
@@ -162,19 +689,24 @@ bool bbl_mqtt_connect()
     uint16_t password_len_be = htons(password_len);
     size_t body_len;
 
-    // TODO: Struct-ify?
-    uint8_t variable_header[10] = {
+    uint16_t keepalive = bbl_config_get_int(ConfigKeyKeepalive);
+
+    mqtt_v5 = bbl_config_get_int(ConfigKeyMQTTv5) != 0;
+
+    uint8_t variable_header[11] = {
         0x00, 0x04, 'M', 'Q', 'T', 'T', // protocol name
-        0x04,                           // protocol level
+        mqtt_v5 ? 0x05 : 0x04,          // protocol level
         0x02,                           // flags
-        0x00, 0x00                      // keepalive
+        keepalive >> 8, keepalive & 0xff,
+        0x00                            // properties length (MQTT 5 only)
     };
-    body_len = sizeof(variable_header) + 2 + id_len;
+    size_t variable_header_len = mqtt_v5 ? 11 : 10;
+    body_len = variable_header_len + 2 + id_len;
 
     struct iovec iov[16];
     int iov_count = 2;
 
-    fill_iovec(&iov[1], variable_header, sizeof(variable_header));
+    fill_iovec(&iov[1], variable_header, variable_header_len);
 
     fill_iovec(&iov[iov_count++], &id_len_be, sizeof(id_len_be));
     fill_iovec(&iov[iov_count++], id, id_len);
@@ -193,111 +725,509 @@ bool bbl_mqtt_connect()
         fill_iovec(&iov[iov_count++], password, password_len);
     }
 
-    // TODO: Last will, QoS, Keepalive
+    // TODO: Last will
 
     header[0] = MQTT_CONNECT;
     header_len = 1 + mqtt_encode_len(&header[1], body_len);
     fill_iovec(&iov[0], header, header_len);
 
-    if (!mqtt_writev(&iov, iov_count)) {
-        goto err;
+    if (!mqtt_writev(iov, iov_count)) {
+        mqtt_fail("connect too large");
+        return;
     }
 
-    while (!mqtt_connack_received) {
-        bbl_mqtt_read(true);
+    mqtt_qos = bbl_config_get_int(ConfigKeyMQTTQoS) > 0;
+    mqtt_window = bbl_config_get_int(ConfigKeyInflight);
+    if (mqtt_window < 1 || mqtt_window > BBL_MQTT_INFLIGHT_MAX) {
+        mqtt_window = BBL_MQTT_INFLIGHT_MAX;
     }
 
-    // TODO: Parse connack_pkt
+    mqtt_keepalive_ms = keepalive * 1000;
+    mqtt_last_received = bbl_millis();
+    mqtt_ping_outstanding = false;
 
-    return true;
+    // Whatever doesn't go out now is finished once the socket is writable
+    mqtt_set_state(MqttStateConnecting);
+    mqtt_send();
+}
+
+static void mqtt_read()
+{
+    for (;;) {
+        size_t offset = mqtt_in_head & (BBL_MQTT_INBUF_SIZE - 1);
+        size_t space = BBL_MQTT_INBUF_SIZE - (mqtt_in_head - mqtt_in_tail);
+        size_t to_read = (space < BBL_MQTT_INBUF_SIZE - offset) ? space : BBL_MQTT_INBUF_SIZE - offset;
+        ssize_t received = bbl_transport_read(mqtt_conn, mqtt_in + offset, to_read);
 
-err:
-    bbl_sleep(5000);
-    mqtt_conn_error = true;
-    bbl_mqtt_disconnect();
-    return false;
+        if (received == 0) {
+            mqtt_fail("closed");
+            break;
+        } else if (received > 0) {
+            mqtt_last_received = bbl_millis();
+            mqtt_in_head += received;
+
+            if (!mqtt_parse()) {
+                break;
+            }
+        } else if (received == BBL_TRANSPORT_WOULD_BLOCK) {
+            break;
+        } else {
+            mqtt_fail("read");
+            break;
+        }
+    }
 }
 
-bool bbl_mqtt_disconnect()
+// Picks the alias for a topic, reusing the least recently used one when all are taken
+static mqtt_alias_t *mqtt_alias_lookup(const char *topic, size_t topic_len)
 {
-    if (mqtt_conn != NULL && !mqtt_conn_error) {
-        uint8_t header[2];
+    if (mqtt_alias_count == 0 || topic_len > MQTT_ALIAS_TOPIC_MAX) {
+        return NULL;
+    }
 
-        header[0] = MQTT_DISCONNECT;
-        header[1] = 0;
+    uint32_t hash = bbl_fnv1a(topic, topic_len);
+    mqtt_alias_t *victim = &mqtt_aliases[0];
 
-        struct iovec iov[] = {
-            { header, sizeof(header) },
-        };
+    for (size_t i = 0; i < mqtt_alias_count; ++i) {
+        mqtt_alias_t *alias = &mqtt_aliases[i];
 
-        mqtt_writev(iov, LWIP_ARRAYSIZE(iov));
+        if (alias->hash == hash && alias->topic_len == topic_len && memcmp(alias->topic, topic, topic_len) == 0) {
+            return alias;
+        }
+
+        if ((int32_t)(alias->last_used - victim->last_used) < 0) {
+            victim = alias;
+        }
     }
 
-    esp_tls_conn_delete(mqtt_conn);
-    mqtt_conn = NULL;
-    mqtt_conn_error = false;
-    mqtt_connack_received = false;
-    mqtt_buf_used = 0;
-    mqtt_skip = 0;
+    victim->hash = hash;
+    victim->topic_len = topic_len;
+    victim->established = false;
+    memcpy(victim->topic, topic, topic_len);
+    return victim;
+}
 
-    return true;
+static size_t mqtt_packet_len(size_t remaining)
+{
+    uint8_t len[4];
+
+    return 1 + mqtt_encode_len(len, remaining) + remaining;
 }
 
-bool bbl_mqtt_publish(const char *topic, const void *payload, size_t payload_len)
+static bool mqtt_write_publish(const mqtt_msg_t *msg, uint16_t packet_id, bool dup)
 {
+    const char *topic = (const char *)(msg + 1);
+    const uint8_t *payload = (const uint8_t *)topic + msg->topic_len;
     uint8_t header[5];
     size_t header_len;
-    uint16_t topic_len = strlen(topic);
+    size_t topic_len = msg->topic_len;
+    uint16_t packet_id_be = htons(packet_id);
+    size_t packet_id_len = packet_id ? sizeof(packet_id_be) : 0;
+    uint8_t properties[4] = { 0 };
+    size_t properties_len = 0;
+    mqtt_alias_t *alias = NULL;
+
+    if (mqtt_v5) {
+        alias = mqtt_alias_lookup(topic, topic_len);
+        properties_len = 1;
+
+        if (alias != NULL) {
+            uint16_t alias_id = alias - mqtt_aliases + 1;
+
+            properties[0] = 3;
+            properties[1] = MQTT_PROP_TOPIC_ALIAS;
+            properties[2] = alias_id >> 8;
+            properties[3] = alias_id & 0xff;
+            properties_len = 4;
+
+            // Once the broker knows the alias, the topic can be left empty
+            if (alias->established) {
+                topic_len = 0;
+            }
+        }
+    }
+
     uint16_t topic_len_be = htons(topic_len);
+    size_t remaining = 2 + topic_len + packet_id_len + properties_len + msg->payload_len;
 
-    header[0] = MQTT_PUBLISH;
-    header_len = 1 + mqtt_encode_len(&header[1], 2 + topic_len + payload_len);
+    header[0] = MQTT_PUBLISH | (packet_id ? MQTT_PUBLISH_QOS1 : 0) | (dup ? MQTT_PUBLISH_DUP : 0);
+    header_len = 1 + mqtt_encode_len(&header[1], remaining);
 
     struct iovec iov[] = {
-        { header,        header_len },
-        { &topic_len_be, sizeof(topic_len_be) },
-        { topic,         topic_len },
-        { payload,       payload_len }
+        { header,                header_len },
+        { &topic_len_be,         sizeof(topic_len_be) },
+        { (void *)topic,         topic_len },
+        { &packet_id_be,         packet_id_len },
+        { properties,            properties_len },
+        { (void *)payload,       msg->payload_len }
     };
 
-    bbl_mqtt_read(false);
+    if (!mqtt_writev(iov, LWIP_ARRAYSIZE(iov))) {
+        return false;
+    }
+
+    if (mqtt_v5) {
+        // Measured against the same message sent with MQTT 3.1.1
+        size_t v311_len = mqtt_packet_len(2 + msg->topic_len + packet_id_len + msg->payload_len);
+        mqtt_stats.alias_bytes_saved += (int64_t)v311_len - (int64_t)(header_len + remaining);
+    }
 
-    return mqtt_writev(iov, LWIP_ARRAYSIZE(iov));
+    if (alias != NULL) {
+        alias->established = true;
+        alias->last_used = ++mqtt_alias_clock;
+    }
+
+    return true;
 }
 
-void bbl_mqtt_read(bool block)
+static bool mqtt_write_subscribe()
 {
-    while (block || mbedtls_ssl_get_bytes_avail(&mqtt_conn->ssl) > 0) {
-        void *read_ptr = mqtt_buf + mqtt_buf_used;
-        int to_read = sizeof(mqtt_buf) - mqtt_buf_used;
-        ssize_t received = esp_tls_conn_read(mqtt_conn, read_ptr, to_read);
+    size_t count = mqtt_handler_count;
+    uint8_t header[5];
+    size_t header_len;
+    size_t remaining = 2 + mqtt_v5;
+    uint16_t topic_len_be[BBL_MQTT_HANDLERS];
+    uint8_t options = 0x00;     // QoS 0
+    uint8_t properties = 0x00;
+    struct iovec iov[3 + 3 * BBL_MQTT_HANDLERS];
+    int iov_count = 1;
 
-        if (received == 0) {
+    // Zero is not a valid packet identifier
+    uint16_t packet_id = (mqtt_packet_id == UINT16_MAX) ? 1 : mqtt_packet_id + 1;
+    uint16_t packet_id_be = htons(packet_id);
+
+    fill_iovec(&iov[iov_count++], &packet_id_be, sizeof(packet_id_be));
+    fill_iovec(&iov[iov_count++], &properties, mqtt_v5);
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t topic_len = strlen(mqtt_handlers[i].topic);
+
+        topic_len_be[i] = htons(topic_len);
+        fill_iovec(&iov[iov_count++], &topic_len_be[i], sizeof(topic_len_be[i]));
+        fill_iovec(&iov[iov_count++], mqtt_handlers[i].topic, topic_len);
+        fill_iovec(&iov[iov_count++], &options, sizeof(options));
+        remaining += 2 + topic_len + 1;
+    }
+
+    // SUBSCRIBE has a fixed flags nibble of 0b0010
+    header[0] = MQTT_SUBSCRIBE | 0x02;
+    header_len = 1 + mqtt_encode_len(&header[1], remaining);
+    fill_iovec(&iov[0], header, header_len);
+
+    if (!mqtt_writev(iov, iov_count)) {
+        return false;
+    }
+
+    mqtt_packet_id = packet_id;
+    mqtt_subscribe_pending = false;
+    return true;
+}
+
+// Moves messages into the output buffer until it, the queue or the in-flight window runs out.
+// Returns true when it stopped because the buffer is full.
+static bool mqtt_fill()
+{
+    if (mqtt_subscribe_pending && !mqtt_write_subscribe()) {
+        return true;
+    }
+
+    // Whatever the last connection left unacknowledged goes first, flagged as a duplicate
+    while (mqtt_resend_next < mqtt_inflight_count) {
+        mqtt_inflight_t *slot = mqtt_inflight_at(mqtt_resend_next);
+
+        if (!slot->acked) {
+            if (!mqtt_write_publish(slot->msg, slot->packet_id, true)) {
+                return true;
+            }
+            slot->sent_millis = bbl_millis();
+            ++mqtt_stats.retransmits;
+        }
+        ++mqtt_resend_next;
+    }
+
+    for (;;) {
+        if (mqtt_pending == NULL) {
+            if (mqtt_qos > 0 && mqtt_inflight_count >= mqtt_window) {
+                return false;
+            }
+
+            mqtt_pending = xRingbufferReceive(mqtt_queue, &mqtt_pending_size, 0);
+            if (mqtt_pending == NULL) {
+                return false;
+            }
+        }
+
+        uint16_t packet_id = 0;
+        if (mqtt_qos > 0) {
+            // Zero is not a valid packet identifier
+            packet_id = (mqtt_packet_id == UINT16_MAX) ? 1 : mqtt_packet_id + 1;
+        }
+
+        if (!mqtt_write_publish(mqtt_pending, packet_id, false)) {
+            return true;
+        }
+
+        ++mqtt_stats.publishes;
+
+        if (packet_id == 0) {
+            vRingbufferReturnItem(mqtt_queue, mqtt_pending);
+        } else {
+            mqtt_inflight_t *slot = mqtt_inflight_at(mqtt_inflight_count++);
+
+            mqtt_packet_id = packet_id;
+            slot->msg = mqtt_pending;
+            slot->packet_id = packet_id;
+            slot->acked = false;
+            slot->sent_millis = bbl_millis();
+            mqtt_resend_next = mqtt_inflight_count;
+        }
+
+        mqtt_pending = NULL;
+    }
+}
+
+// Gives up on a connection the broker has stopped answering.  This doesn't need the output
+// buffer, so it still runs while a send is stuck behind a half-open link.
+static bool mqtt_check_deadline()
+{
+    uint32_t now = bbl_millis();
+
+    if (mqtt_keepalive_ms == 0) {
+        return true;
+    }
+
+    if (mqtt_ping_outstanding && now - mqtt_ping_sent >= MQTT_PING_TIMEOUT_MS) {
+        ++mqtt_stats.ping_timeouts;
+        mqtt_fail("ping timeout");
+        return false;
+    }
+
+    // The broker itself allows one and a half keepalive periods of silence
+    if (now - mqtt_last_received >= mqtt_keepalive_ms + mqtt_keepalive_ms / 2) {
+        mqtt_fail("keepalive timeout");
+        return false;
+    }
+
+    return true;
+}
+
+// Pings well before the broker's keepalive deadline, and whenever the broker has been quiet for
+// that long even while we publish, so a half-open connection is noticed and replaced here rather
+// than by a failing publish
+static bool mqtt_keepalive()
+{
+    uint32_t now = bbl_millis();
+
+    if (mqtt_keepalive_ms == 0 || mqtt_ping_outstanding) {
+        return true;
+    }
+
+    if (now - mqtt_last_sent < mqtt_keepalive_ms / 2 && now - mqtt_last_received < mqtt_keepalive_ms / 2) {
+        return true;
+    }
+
+    uint8_t pingreq[] = { MQTT_PINGREQ, 0x00 };
+    struct iovec iov[] = {
+        { pingreq, sizeof(pingreq) },
+    };
+
+    // If the buffer is busy, it is about to be sent anyway; try again next time round
+    if (!mqtt_writev(iov, LWIP_ARRAYSIZE(iov))) {
+        return true;
+    }
+
+    mqtt_ping_sent = now;
+    mqtt_ping_outstanding = true;
+    ++mqtt_stats.pings;
+    return mqtt_send();
+}
+
+static void mqtt_service()
+{
+    int sock = bbl_transport_sockfd(mqtt_conn);
+    fd_set readfds;
+    fd_set writefds;
+    struct timeval tv = { 0, MQTT_POLL_MS * 1000 };
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_SET(sock, &readfds);
+    if (mqtt_out_sending) {
+        FD_SET(sock, &writefds);
+    }
+
+    // Records mbedTLS has already decrypted won't show up as socket readability
+    if (bbl_transport_pending(mqtt_conn) > 0) {
+        tv.tv_usec = 0;
+    }
+
+    if (select(sock + 1, &readfds, &writefds, NULL, &tv) < 0) {
+        mqtt_fail("select");
+        return;
+    }
+
+    mqtt_read();
+    if (mqtt_conn == NULL) {
+        return;
+    }
+
+    if (mqtt_state == MqttStateConnected && !mqtt_check_deadline()) {
+        return;
+    }
+
+    if (mqtt_out_sending && !mqtt_send()) {
+        return;
+    }
+
+    if (mqtt_state == MqttStateConnecting) {
+        if (bbl_millis() - mqtt_state_millis >= MQTT_CONNACK_TIMEOUT_MS) {
+            mqtt_fail("connack timeout");
+        }
+        return;
+    }
+
+    if (mqtt_out_sending || !mqtt_keepalive()) {
+        return;
+    }
+
+    // Send on a full buffer, an explicit flush, or once the linger expires
+    bool flush = mqtt_fill();
+    mqtt_out_more = flush;
+    if (mqtt_flush_requested && !flush) {
+        mqtt_flush_requested = false;
+        flush = true;
+    }
+    if (bbl_millis() - mqtt_out_started >= BBL_MQTT_LINGER_MS) {
+        flush = true;
+    }
+
+    if (flush && mqtt_out_used > 0) {
+        mqtt_send();
+    }
+}
+
+static void mqtt_take_stats_snapshot()
+{
+    xSemaphoreTake(mqtt_queue_lock, portMAX_DELAY);
+    mqtt_stats_snapshot = mqtt_stats;
+    mqtt_stats_snapshot.inflight = mqtt_inflight_count;
+    xSemaphoreGive(mqtt_queue_lock);
+}
+
+static void mqtt_task_thread()
+{
+    for (;;) {
+        mqtt_take_stats_snapshot();
+
+        switch (mqtt_state) {
+        case MqttStateIdle:
+            if (xEventGroupWaitBits(bbl_wifi_event_group, BBL_WIFI_CONNECTED_BIT, false, true, portMAX_DELAY) & BBL_WIFI_CONNECTED_BIT) {
+                mqtt_open();
+            }
             break;
-        } else if (received > 0) {
-            if (mqtt_skip >= received) {
-                mqtt_skip -= received;
-                continue;
-            } else if (mqtt_skip > 0) {
-                received -= mqtt_skip;
-                memmove(&mqtt_buf[0], &mqtt_buf[mqtt_skip], received);
-                mqtt_skip = 0;
+
+        case MqttStateConnecting:
+        case MqttStateConnected:
+            mqtt_service();
+            break;
+
+        case MqttStateBackoff: {
+            uint32_t waited = bbl_millis() - mqtt_state_millis;
+            if (waited < mqtt_backoff_ms) {
+                bbl_sleep(mqtt_backoff_ms - waited);
             }
-            mqtt_buf_used += received;
-
-            int parsed;
-            do {
-                parsed = mqtt_parse(mqtt_buf, mqtt_buf_used);
-                if (parsed > 0) {
-                    mqtt_buf_used -= parsed;
-                    memmove(&mqtt_buf[0], &mqtt_buf[parsed], mqtt_buf_used);
-                    block = false;
-                }
-            } while (mqtt_buf_used > 0 && parsed > 0);
-        } else if (MBEDTLS_ERR_SSL_WANT_READ != received && MBEDTLS_ERR_SSL_WANT_WRITE != received) {
-            mqtt_conn_error = true;
-            bbl_mqtt_disconnect();
+            mqtt_set_state(MqttStateIdle);
             break;
         }
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+void bbl_mqtt_init()
+{
+    mqtt_queue = xRingbufferCreate(BBL_MQTT_QUEUE_SIZE, RINGBUF_TYPE_NOSPLIT);
+    mqtt_queue_lock = xSemaphoreCreateMutex();
+    mqtt_set_state(MqttStateIdle);
+
+    xTaskCreate(mqtt_task_thread, "mqtt", 8192, NULL, 5, &mqtt_task);
+    bbl_metrics_add_task(mqtt_task);
+}
+
+bool bbl_mqtt_enqueue(const char *topic, const void *payload, size_t payload_len)
+{
+    size_t topic_len = strlen(topic);
+
+    if (topic_len + payload_len > MQTT_MAX_MESSAGE) {
+        return false;
+    }
+
+    xSemaphoreTake(mqtt_queue_lock, portMAX_DELAY);
+
+    mqtt_msg_t *msg = (mqtt_msg_t *)mqtt_queue_scratch;
+    msg->topic_len = topic_len;
+    msg->payload_len = payload_len;
+    memcpy(msg + 1, topic, topic_len);
+    memcpy((uint8_t *)(msg + 1) + topic_len, payload, payload_len);
+
+    // Never wait for room; a full queue means the broker is unreachable or too slow
+    bool queued = xRingbufferSend(mqtt_queue, msg, sizeof(*msg) + topic_len + payload_len, 0) == pdTRUE;
+
+    xSemaphoreGive(mqtt_queue_lock);
+
+    return queued;
+}
+
+bool bbl_mqtt_publish(const char *topic, const void *payload, size_t payload_len)
+{
+    if (!bbl_mqtt_enqueue(topic, payload, payload_len)) {
+        xSemaphoreTake(mqtt_queue_lock, portMAX_DELAY);
+        ++mqtt_dropped;
+        xSemaphoreGive(mqtt_queue_lock);
+        return false;
+    }
+
+    return true;
+}
+
+bool bbl_mqtt_subscribe(const char *topic, bbl_mqtt_handler_t handler)
+{
+    size_t count = mqtt_handler_count;
+
+    if (count >= BBL_MQTT_HANDLERS || strlen(topic) >= MQTT_HANDLER_TOPIC_MAX) {
+        return false;
     }
+
+    strcpy(mqtt_handlers[count].topic, topic);
+    mqtt_handlers[count].handler = handler;
+
+    // Only visible to the client task once filled in
+    mqtt_handler_count = count + 1;
+    return true;
+}
+
+void bbl_mqtt_flush()
+{
+    mqtt_flush_requested = true;
+}
+
+bool bbl_mqtt_connected()
+{
+    return mqtt_state == MqttStateConnected;
+}
+
+size_t bbl_mqtt_queue_free()
+{
+    return xRingbufferGetCurFreeSize(mqtt_queue);
+}
+
+void bbl_mqtt_stats(bbl_mqtt_stats_t *stats)
+{
+    xSemaphoreTake(mqtt_queue_lock, portMAX_DELAY);
+    *stats = mqtt_stats_snapshot;
+    stats->dropped = mqtt_dropped;
+    xSemaphoreGive(mqtt_queue_lock);
+
+    stats->queue_free = bbl_mqtt_queue_free();
 }
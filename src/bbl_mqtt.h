@@ -7,10 +7,52 @@
 #include <stddef.h>
 #include <stdint.h>
 
-bool bbl_mqtt_connect();
-bool bbl_mqtt_disconnect();
+typedef struct bbl_mqtt_stats bbl_mqtt_stats_t;
+
+// Called from the client task with successive pieces of an inbound PUBLISH payload, however large;
+// offset + len == total on the last piece
+typedef void (*bbl_mqtt_handler_t)(const char *topic, const uint8_t *data, size_t len, size_t offset, size_t total);
+
+struct bbl_mqtt_stats {
+    uint32_t publishes;
+    uint32_t writes;            // Calls into the transport, each one at least one TLS record
+    uint64_t bytes_written;
+    uint32_t dropped;           // Messages bbl_mqtt_publish() refused for want of queue space
+    uint32_t connects;
+    uint32_t connect_failures;  // Attempts that never got a CONNACK
+    uint32_t disconnects;       // Established sessions lost
+    uint32_t queue_free;
+    uint32_t pings;
+    uint32_t ping_timeouts;
+    uint32_t ping_rtt_ms;       // Most recent PINGREQ to PINGRESP
+    uint32_t acked;             // QoS 1 publishes acknowledged
+    uint32_t retransmits;
+    uint32_t inflight;
+    uint64_t rtt_total_ms;      // PUBLISH to PUBACK, summed over every acked message
+    uint32_t rtt_max_ms;
+    int64_t alias_bytes_saved;  // Against MQTT 3.1.1, negative until aliases pay for themselves
+    uint32_t tls_handshakes;
+    uint32_t tls_resumed;       // Handshakes that reused the previous session
+    uint32_t tls_handshake_ms;  // Most recent handshake
+    uint32_t received;          // Inbound PUBLISHes
+    uint32_t rx_dropped;        // Inbound packets too large to handle
+    uint32_t sub_failures;      // Topics the broker refused in a SUBACK
+};
+
+// The client runs in its own task; publishing only queues the message and never blocks on the network
+void bbl_mqtt_init();
 bool bbl_mqtt_publish(const char *topic, const void *payload, size_t payload_len);
-// TODO: Need to set callbacks for bbl_mqtt_read to invoke
-void bbl_mqtt_read(bool block);
+// Like bbl_mqtt_publish(), but a refused message isn't counted as dropped, for callers that keep it
+bool bbl_mqtt_enqueue(const char *topic, const void *payload, size_t payload_len);
+// Subscribes (at QoS 0) on every connection from now on.  Subscriptions can only be added, and
+// inbound topics must match exactly.
+bool bbl_mqtt_subscribe(const char *topic, bbl_mqtt_handler_t handler);
+// Asks the client task to send whatever it has buffered instead of waiting for the linger to expire
+void bbl_mqtt_flush();
+bool bbl_mqtt_connected();
+size_t bbl_mqtt_queue_free();
+// Copies the counters as the client task last published them, at most one poll old, so they are
+// consistent with each other; any task may call it
+void bbl_mqtt_stats(bbl_mqtt_stats_t *stats);
 
 #endif
@@ -0,0 +1,64 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_ring.h"
+
+void bbl_ring_init(bbl_ring_t *ring, void *records, size_t record_size, size_t record_count)
+{
+    ring->records = records;
+    ring->record_size = record_size;
+    ring->mask = record_count - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ring->overflows = 0;
+    ring->high_water = 0;
+    ring->overflowing = false;
+}
+
+void *bbl_ring_reserve(bbl_ring_t *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t used = ring->head - tail;
+
+    if (used > ring->mask) {
+        if (!ring->overflowing) {
+            ring->overflowing = true;
+            ++ring->overflows;
+        }
+        ++ring->dropped;
+        return NULL;
+    }
+
+    ring->overflowing = false;
+    if (used + 1 > ring->high_water) {
+        ring->high_water = used + 1;
+    }
+
+    return ring->records + (ring->head & ring->mask) * ring->record_size;
+}
+
+void bbl_ring_commit(bbl_ring_t *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+const void *bbl_ring_peek(bbl_ring_t *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == ring->tail) {
+        return NULL;
+    }
+
+    return ring->records + (ring->tail & ring->mask) * ring->record_size;
+}
+
+void bbl_ring_release(bbl_ring_t *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t bbl_ring_count(const bbl_ring_t *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
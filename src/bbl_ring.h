@@ -0,0 +1,43 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __25cd0bee_82e4_4ab2_be71_deacdecded95__
+#define __25cd0bee_82e4_4ab2_be71_deacdecded95__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring of fixed-size records.  The
+// producer fills records in place with reserve/commit and the consumer reads
+// them in place with peek/release, so neither side copies twice or blocks.
+// Record storage is provided by the caller; the record count must be a power
+// of two.
+
+typedef struct bbl_ring bbl_ring_t;
+
+struct bbl_ring {
+    uint8_t *records;
+    size_t record_size;
+    uint32_t mask;
+
+    uint32_t head;          // Written by the producer only
+    uint32_t tail;          // Written by the consumer only
+
+    // Producer-side counters
+    uint32_t dropped;       // Records rejected because the ring was full
+    uint32_t overflows;     // Times the ring went from accepting to full
+    uint32_t high_water;    // Most records ever queued at once
+    bool overflowing;
+};
+
+void bbl_ring_init(bbl_ring_t *ring, void *records, size_t record_size, size_t record_count);
+
+void *bbl_ring_reserve(bbl_ring_t *ring);
+void bbl_ring_commit(bbl_ring_t *ring);
+
+const void *bbl_ring_peek(bbl_ring_t *ring);
+void bbl_ring_release(bbl_ring_t *ring);
+
+uint32_t bbl_ring_count(const bbl_ring_t *ring);
+
+#endif
@@ -0,0 +1,589 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_spool.h"
+#include "bbl_config.h"
+#include "bbl_mqtt.h"
+#include "bbl_utils.h"
+#include "bbl_log.h"
+
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include <stdio.h>
+#include <string.h>
+
+// Longest appended records wait in RAM before their sector is written
+#ifndef BBL_SPOOL_FLUSH_MS
+    #define BBL_SPOOL_FLUSH_MS 5000
+#endif
+// Records replayed per second once the broker is back
+#ifndef BBL_SPOOL_REPLAY_RATE
+    #define BBL_SPOOL_REPLAY_RATE 20
+#endif
+#define SPOOL_SECTOR_SIZE SPI_FLASH_SEC_SIZE
+#define SPOOL_MAGIC 0x4c4f5053  // "SPOL"
+#define SPOOL_END 0xffff        // Length of the erased space after the last record
+#define SPOOL_PENDING 0xff
+#define SPOOL_REPLAYED 0x00
+#define SPOOL_ALIGN(len) (((len) + 3) & ~3)
+// Most reports in one batch that get their age stamped
+#define SPOOL_REPORTS_MAX 64
+// CBOR initial bytes for the payloads bbl_ble publishes
+#define SPOOL_CBOR_MAP 0xa0
+#define SPOOL_CBOR_MAP_MAX 0xb7         // Largest map whose size fits the initial byte
+#define SPOOL_CBOR_ARRAY 0x9f
+#define SPOOL_CBOR_BREAK 0xff
+
+typedef struct spool_sector_header spool_sector_header_t;
+typedef struct spool_record_header spool_record_header_t;
+
+struct spool_sector_header {
+    uint32_t magic;
+    uint32_t seq;               // Increases with every sector written
+    uint32_t boot;              // Boot count when the sector was started
+};
+
+// Followed by the topic and payload, padded to a multiple of four bytes
+struct spool_record_header {
+    uint16_t len;               // Topic and payload
+    uint8_t topic_len;
+    uint8_t state;              // Cleared in place once replayed
+    uint32_t millis;
+};
+
+#define SPOOL_RECORD_MAX (SPOOL_SECTOR_SIZE - sizeof(spool_sector_header_t) - sizeof(spool_record_header_t))
+
+static const esp_partition_t *spool_partition;
+static size_t spool_sectors;
+static uint32_t spool_boot;
+static uint32_t spool_seq;
+
+// The sector being appended to, mirrored in RAM so it can be written in batches
+static bool spool_head_valid;
+static size_t spool_head;
+static uint8_t spool_page[SPOOL_SECTOR_SIZE];
+static size_t spool_page_used;
+static size_t spool_page_written;
+static uint32_t spool_page_millis;  // When the oldest unwritten record was appended
+
+// Replay cursor
+static size_t spool_tail;
+static size_t spool_tail_offset;
+static uint32_t spool_tail_boot;
+static uint32_t spool_replay_millis;
+static uint8_t spool_replay_buf[SPOOL_RECORD_MAX];
+
+static bbl_spool_stats_t spool_stats;
+
+// Every spooled report gets a spooled_ms field, inserted just inside its object or map with room
+// for the value, which is filled in at replay.  Spaces before a JSON number are fine, and so is a
+// CBOR uint that always takes four bytes.
+static const char spool_json_stamp[] = "\"spooled_ms\":          ,";
+static const uint8_t spool_cbor_stamp[] = { 0x6a, 's', 'p', 'o', 'o', 'l', 'e', 'd', '_', 'm', 's', 0x1a, 0, 0, 0, 0 };
+#define SPOOL_JSON_STAMP_LEN (sizeof(spool_json_stamp) - 1)
+#define SPOOL_JSON_AGE_DIGITS 10
+#define SPOOL_CBOR_AGE_LEN 4
+
+static size_t spool_record_size(const spool_record_header_t *record)
+{
+    return sizeof(*record) + SPOOL_ALIGN(record->len);
+}
+
+static bool spool_read_sector_header(size_t sector, spool_sector_header_t *header)
+{
+    return esp_partition_read(spool_partition, sector * SPOOL_SECTOR_SIZE, header, sizeof(*header)) == ESP_OK &&
+        header->magic == SPOOL_MAGIC;
+}
+
+// False at the end of the records in the sector
+static bool spool_read_record(size_t sector, size_t offset, size_t limit, spool_record_header_t *record)
+{
+    return offset + sizeof(*record) <= limit &&
+        esp_partition_read(spool_partition, sector * SPOOL_SECTOR_SIZE + offset, record, sizeof(*record)) == ESP_OK &&
+        record->len != SPOOL_END && offset + spool_record_size(record) <= limit;
+}
+
+static size_t spool_count_pending(size_t sector, size_t *end)
+{
+    spool_record_header_t record;
+    size_t offset = sizeof(spool_sector_header_t);
+    size_t pending = 0;
+
+    while (spool_read_record(sector, offset, SPOOL_SECTOR_SIZE, &record)) {
+        pending += (record.state == SPOOL_PENDING);
+        offset += spool_record_size(&record);
+    }
+
+    if (end != NULL) {
+        *end = offset;
+    }
+
+    return pending;
+}
+
+static void spool_set_tail(size_t sector)
+{
+    spool_sector_header_t header;
+
+    spool_tail = sector;
+    spool_tail_offset = sizeof(header);
+    spool_tail_boot = spool_read_sector_header(sector, &header) ? header.boot : spool_boot;
+}
+
+static void spool_write_page()
+{
+    if (spool_page_written >= spool_page_used) {
+        return;
+    }
+
+    // Offsets and lengths stay word aligned, and flash is only ever programmed once per byte
+    // here; replay clears state bytes separately
+    esp_partition_write(spool_partition, spool_head * SPOOL_SECTOR_SIZE + spool_page_written,
+        spool_page + spool_page_written, spool_page_used - spool_page_written);
+    spool_page_written = spool_page_used;
+    ++spool_stats.sector_writes;
+}
+
+static bool spool_next_sector()
+{
+    size_t next = spool_head_valid ? (spool_head + 1) % spool_sectors : spool_tail;
+
+    spool_write_page();
+
+    if (spool_head_valid && next == spool_tail && spool_stats.depth > 0) {
+        // Full: the oldest sector goes, records still waiting in it included
+        size_t lost = spool_count_pending(next, NULL);
+
+        spool_stats.depth -= lost;
+        spool_stats.dropped += lost;
+        BBL_LOG("Spool full, dropped %u records", (unsigned int)lost);
+        spool_set_tail((next + 1) % spool_sectors);
+    }
+
+    if (esp_partition_erase_range(spool_partition, next * SPOOL_SECTOR_SIZE, SPOOL_SECTOR_SIZE) != ESP_OK) {
+        spool_head_valid = false;
+        return false;
+    }
+    ++spool_stats.sector_erases;
+
+    spool_sector_header_t *header = (spool_sector_header_t *)spool_page;
+
+    memset(spool_page, 0xff, sizeof(spool_page));
+    header->magic = SPOOL_MAGIC;
+    header->seq = ++spool_seq;
+    header->boot = spool_boot;
+
+    spool_head = next;
+    spool_head_valid = true;
+    spool_page_used = sizeof(*header);
+    spool_page_written = 0;
+
+    if (spool_stats.depth == 0) {
+        spool_set_tail(next);
+    }
+
+    return true;
+}
+
+// Finds the newest sector to keep appending to and the oldest record not yet replayed
+static void spool_recover()
+{
+    spool_sector_header_t header;
+    size_t oldest = 0;
+    bool found = false;
+
+    for (size_t i = 0; i < spool_sectors; ++i) {
+        if (spool_read_sector_header(i, &header) && (!spool_head_valid || (int32_t)(header.seq - spool_seq) > 0)) {
+            spool_head = i;
+            spool_seq = header.seq;
+            spool_head_valid = true;
+        }
+    }
+
+    if (!spool_head_valid) {
+        spool_set_tail(0);
+        return;
+    }
+
+    // Sectors are used in order, so the oldest one follows the newest
+    for (size_t n = 1; n <= spool_sectors; ++n) {
+        size_t sector = (spool_head + n) % spool_sectors;
+
+        if (!spool_read_sector_header(sector, &header)) {
+            continue;
+        }
+
+        size_t pending = spool_count_pending(sector, NULL);
+        if (pending > 0 && !found) {
+            oldest = sector;
+            found = true;
+        }
+        spool_stats.depth += pending;
+    }
+
+    spool_set_tail(found ? oldest : spool_head);
+
+    // Carry on filling the newest sector where it left off
+    size_t end;
+    spool_count_pending(spool_head, &end);
+    esp_partition_read(spool_partition, spool_head * SPOOL_SECTOR_SIZE, spool_page, sizeof(spool_page));
+    spool_page_used = end;
+    spool_page_written = end;
+}
+
+void bbl_spool_init()
+{
+    spool_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    if (spool_partition == NULL) {
+        BBL_LOG("No spool partition");
+        return;
+    }
+
+    spool_sectors = spool_partition->size / SPOOL_SECTOR_SIZE;
+    spool_boot = bbl_config_get_int(ConfigKeyBootCount);
+    spool_recover();
+
+    BBL_LOG("Spool has %u records waiting in %u sectors", spool_stats.depth, (unsigned int)spool_sectors);
+}
+
+static bool spool_is_cbor(const uint8_t *payload)
+{
+    return *payload == SPOOL_CBOR_ARRAY || (*payload >= SPOOL_CBOR_MAP && *payload <= SPOOL_CBOR_MAP_MAX);
+}
+
+// Length of the CBOR data item at p, or 0 if it is malformed or runs past len
+static size_t spool_cbor_skip(const uint8_t *p, size_t len)
+{
+    size_t head = 1;
+    uint64_t value;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    uint8_t major = p[0] >> 5;
+    uint8_t info = p[0] & 0x1f;
+
+    if (info < 24) {
+        value = info;
+    } else if (info <= 27) {
+        size_t n = 1 << (info - 24);
+
+        if (len < 1 + n) {
+            return 0;
+        }
+        value = 0;
+        for (size_t i = 1; i <= n; ++i) {
+            value = (value << 8) | p[i];
+        }
+        head += n;
+    } else {
+        // bbl_ble never nests indefinite lengths
+        return 0;
+    }
+
+    switch (major) {
+    case 2:
+    case 3:
+        return (value <= len - head) ? head + value : 0;
+
+    case 4:
+    case 5: {
+        size_t pos = head;
+
+        for (uint64_t i = 0; i < ((major == 5) ? 2 * value : value); ++i) {
+            size_t item = spool_cbor_skip(p + pos, len - pos);
+
+            if (item == 0) {
+                return 0;
+            }
+            pos += item;
+        }
+        return pos;
+    }
+
+    default:
+        // Integers, and simple values whose argument is all there is
+        return head;
+    }
+}
+
+// Finds where each report in a payload starts: the opening brace of a JSON object or the initial
+// byte of a CBOR map, on its own or in a batch.  Returns how many there are, or 0 for anything
+// that doesn't look like bbl_ble's reports.
+static size_t spool_find_reports(const uint8_t *payload, size_t len, size_t *starts)
+{
+    size_t count = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (*payload == '{' || (*payload >= SPOOL_CBOR_MAP && *payload <= SPOOL_CBOR_MAP_MAX)) {
+        starts[0] = 0;
+        return 1;
+    }
+
+    if (*payload == '[') {
+        int depth = 0;
+        bool in_string = false;
+
+        for (size_t i = 0; i < len; ++i) {
+            uint8_t c = payload[i];
+
+            if (in_string) {
+                if (c == '\\') {
+                    ++i;
+                } else if (c == '"') {
+                    in_string = false;
+                }
+            } else if (c == '"') {
+                in_string = true;
+            } else if (c == '{' || c == '[') {
+                if (depth == 1 && c == '{') {
+                    if (count == SPOOL_REPORTS_MAX) {
+                        return 0;
+                    }
+                    starts[count++] = i;
+                }
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                --depth;
+            }
+        }
+
+        return count;
+    }
+
+    if (*payload == SPOOL_CBOR_ARRAY) {
+        size_t pos = 1;
+
+        while (pos < len && payload[pos] != SPOOL_CBOR_BREAK) {
+            size_t item = spool_cbor_skip(payload + pos, len - pos);
+
+            if (item == 0 || payload[pos] < SPOOL_CBOR_MAP || payload[pos] > SPOOL_CBOR_MAP_MAX || count == SPOOL_REPORTS_MAX) {
+                return 0;
+            }
+            starts[count++] = pos;
+            pos += item;
+        }
+
+        return count;
+    }
+
+    return 0;
+}
+
+// Fills in the spooled_ms fields bbl_spool_append() left room for
+static void spool_stamp_age(uint8_t *payload, size_t len, uint32_t age)
+{
+    size_t starts[SPOOL_REPORTS_MAX];
+    size_t count = spool_find_reports(payload, len, starts);
+    bool cbor = spool_is_cbor(payload);
+    const void *stamp = cbor ? (const void *)spool_cbor_stamp : (const void *)spool_json_stamp;
+    size_t stamp_len = cbor ? sizeof(spool_cbor_stamp) : SPOOL_JSON_STAMP_LEN;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t *field = payload + starts[i] + 1;
+
+        // Records spooled before the stamp existed go out as they are
+        if (starts[i] + 1 + stamp_len > len || memcmp(field, stamp, stamp_len - (cbor ? SPOOL_CBOR_AGE_LEN : SPOOL_JSON_AGE_DIGITS + 1)) != 0) {
+            continue;
+        }
+
+        if (cbor) {
+            uint8_t *value = field + stamp_len - SPOOL_CBOR_AGE_LEN;
+
+            value[0] = age >> 24;
+            value[1] = age >> 16;
+            value[2] = age >> 8;
+            value[3] = age;
+        } else {
+            uint8_t *digit = field + stamp_len - 2;
+            uint32_t v = age;
+
+            // Right aligned, the stamp's spaces pad it on the left
+            do {
+                *digit-- = '0' + v % 10;
+                v /= 10;
+            } while (v > 0);
+        }
+    }
+}
+
+size_t bbl_spool_payload_max(size_t topic_len, size_t reports)
+{
+    size_t stamps = reports * ((SPOOL_JSON_STAMP_LEN > sizeof(spool_cbor_stamp)) ? SPOOL_JSON_STAMP_LEN : sizeof(spool_cbor_stamp));
+
+    if (reports > SPOOL_REPORTS_MAX || topic_len > UINT8_MAX || topic_len + stamps > SPOOL_RECORD_MAX) {
+        return 0;
+    }
+
+    return SPOOL_RECORD_MAX - topic_len - stamps;
+}
+
+bool bbl_spool_append(const char *topic, const void *payload, size_t payload_len)
+{
+    size_t topic_len = strlen(topic);
+    size_t starts[SPOOL_REPORTS_MAX];
+    size_t reports = spool_find_reports(payload, payload_len, starts);
+    bool cbor = reports > 0 && spool_is_cbor(payload);
+
+    // A map that can't take one more pair in its initial byte doesn't get stamped
+    for (size_t i = 0; cbor && i < reports; ++i) {
+        if (((const uint8_t *)payload)[starts[i]] == SPOOL_CBOR_MAP_MAX) {
+            reports = 0;
+        }
+    }
+
+    size_t stamp_len = cbor ? sizeof(spool_cbor_stamp) : SPOOL_JSON_STAMP_LEN;
+    size_t stored_len = payload_len + reports * stamp_len;
+    spool_record_header_t record = {
+        .len = topic_len + stored_len,
+        .topic_len = topic_len,
+        .state = SPOOL_PENDING,
+        .millis = bbl_millis(),
+    };
+
+    if (topic_len > UINT8_MAX || topic_len + stored_len > SPOOL_RECORD_MAX) {
+        // Mostly batches near the batch size limit
+        BBL_LOG("Not spooling %u bytes on %s, too large", (unsigned int)payload_len, topic);
+        ++spool_stats.oversized;
+        return false;
+    }
+
+    if (spool_partition == NULL) {
+        ++spool_stats.dropped;
+        return false;
+    }
+
+    if ((!spool_head_valid || spool_page_used + spool_record_size(&record) > SPOOL_SECTOR_SIZE) && !spool_next_sector()) {
+        ++spool_stats.dropped;
+        return false;
+    }
+
+    if (spool_page_written == spool_page_used) {
+        spool_page_millis = record.millis;
+    }
+
+    uint8_t *p = spool_page + spool_page_used;
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), topic, topic_len);
+
+    // Each report gets its stamp right after the byte that opens it
+    uint8_t *out = p + sizeof(record) + topic_len;
+    size_t copied = 0;
+    for (size_t i = 0; i < reports; ++i) {
+        size_t end = starts[i] + 1;
+
+        memcpy(out, (const uint8_t *)payload + copied, end - copied);
+        out += end - copied;
+        copied = end;
+        if (cbor) {
+            // One more pair in the map
+            ++out[-1];
+            memcpy(out, spool_cbor_stamp, stamp_len);
+        } else {
+            memcpy(out, spool_json_stamp, stamp_len);
+        }
+        out += stamp_len;
+    }
+    memcpy(out, (const uint8_t *)payload + copied, payload_len - copied);
+    spool_page_used += spool_record_size(&record);
+
+    ++spool_stats.depth;
+    ++spool_stats.spooled;
+    return true;
+}
+
+static bool spool_replay_one()
+{
+    spool_record_header_t record;
+    char topic[UINT8_MAX + 1];
+
+    // Skip past records already replayed and on to later sectors as they run out
+    for (;;) {
+        size_t limit = (spool_tail == spool_head) ? spool_page_written : SPOOL_SECTOR_SIZE;
+
+        if (spool_read_record(spool_tail, spool_tail_offset, limit, &record)) {
+            if (record.state == SPOOL_PENDING) {
+                break;
+            }
+            spool_tail_offset += spool_record_size(&record);
+        } else if (spool_tail == spool_head) {
+            return false;
+        } else {
+            spool_set_tail((spool_tail + 1) % spool_sectors);
+        }
+    }
+
+    // Leave room in the queue for live reports
+    if (bbl_mqtt_queue_free() < 2 * (sizeof(uint32_t) + record.len)) {
+        return false;
+    }
+
+    size_t offset = spool_tail * SPOOL_SECTOR_SIZE + spool_tail_offset;
+    if (esp_partition_read(spool_partition, offset + sizeof(record), spool_replay_buf, record.len) != ESP_OK) {
+        return false;
+    }
+
+    // Timestamps from an earlier boot only tell us it has been at least this boot's uptime
+    uint32_t age = bbl_millis() - ((spool_tail_boot == spool_boot) ? record.millis : 0);
+
+    memcpy(topic, spool_replay_buf, record.topic_len);
+    topic[record.topic_len] = '\0';
+    spool_stamp_age(spool_replay_buf + record.topic_len, record.len - record.topic_len, age);
+
+    // The original topic, so subscribers see replays alongside live reports
+    if (!bbl_mqtt_enqueue(topic, spool_replay_buf + record.topic_len, record.len - record.topic_len)) {
+        return false;
+    }
+
+    uint8_t replayed = SPOOL_REPLAYED;
+    esp_partition_write(spool_partition, offset + offsetof(spool_record_header_t, state), &replayed, sizeof(replayed));
+
+    spool_stats.lag_ms = age;
+    spool_tail_offset += spool_record_size(&record);
+    --spool_stats.depth;
+    ++spool_stats.replayed;
+    return true;
+}
+
+void bbl_spool_service()
+{
+    uint32_t now = bbl_millis();
+
+    if (spool_partition == NULL) {
+        return;
+    }
+
+    if (spool_page_written < spool_page_used && now - spool_page_millis >= BBL_SPOOL_FLUSH_MS) {
+        spool_write_page();
+    }
+
+    if (spool_stats.depth == 0 || !bbl_mqtt_connected()) {
+        spool_replay_millis = now;
+        return;
+    }
+
+    uint32_t budget = (now - spool_replay_millis) * BBL_SPOOL_REPLAY_RATE / 1000;
+    if (budget == 0) {
+        return;
+    }
+
+    // Replay reads from flash, so whatever is still in RAM goes out first
+    spool_write_page();
+
+    spool_replay_millis += budget * 1000 / BBL_SPOOL_REPLAY_RATE;
+    if (budget > BBL_SPOOL_REPLAY_RATE) {
+        budget = BBL_SPOOL_REPLAY_RATE;
+        spool_replay_millis = now;
+    }
+
+    while (budget-- > 0 && spool_replay_one()) {
+    }
+}
+
+const bbl_spool_stats_t *bbl_spool_stats()
+{
+    return &spool_stats;
+}
@@ -0,0 +1,39 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __3c9d6e20_f418_4b57_8a3e_d07b5a91c4e6__
+#define __3c9d6e20_f418_4b57_8a3e_d07b5a91c4e6__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Store-and-forward for reports the MQTT client couldn't take.  Records are appended to a log on
+// the spiffs partition (used raw, not as a filesystem) that is written a sector at a time and
+// reused round-robin, so every sector is erased once per trip around the partition.  Once the
+// broker is back they are replayed oldest first at a limited rate, on their original topic.  Each
+// report in a replayed payload carries a spooled_ms field with the time since it was captured.
+// Not thread safe; everything runs on the BLE publisher task.
+
+typedef struct bbl_spool_stats bbl_spool_stats_t;
+
+struct bbl_spool_stats {
+    uint32_t depth;             // Records waiting to be replayed
+    uint32_t spooled;
+    uint32_t replayed;
+    uint32_t dropped;           // Overwritten before they could be replayed, or never written
+    uint32_t oversized;         // Larger than a sector holds, so never spooled
+    uint32_t lag_ms;            // Time the last replayed record spent in the spool
+    uint32_t sector_writes;
+    uint32_t sector_erases;
+};
+
+void bbl_spool_init();
+bool bbl_spool_append(const char *topic, const void *payload, size_t payload_len);
+// Largest payload holding this many reports that bbl_spool_append() can still take, stamps
+// included; 0 when that many won't fit at all
+size_t bbl_spool_payload_max(size_t topic_len, size_t reports);
+// Writes out buffered records that have waited long enough, and replays what the rate allows
+void bbl_spool_service();
+const bbl_spool_stats_t *bbl_spool_stats();
+
+#endif
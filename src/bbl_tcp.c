@@ -0,0 +1,133 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_tcp.h"
+#include "bbl_utils.h"
+#include "bbl_log.h"
+
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <errno.h>
+#include <stdlib.h>
+
+// Socket send buffer to ask for, 0 to keep the lwIP default.  lwIP builds without SO_SNDBUF
+// support refuse it, which is logged and otherwise ignored.
+#ifndef BBL_TCP_SNDBUF
+    #define BBL_TCP_SNDBUF 0
+#endif
+
+typedef struct bbl_tcp bbl_tcp_t;
+
+struct bbl_tcp {
+    bbl_transport_t transport;
+    int sock;
+};
+
+// errno is only meaningful right after the call that failed, so it is checked here and nowhere else
+static ssize_t tcp_result(ssize_t result)
+{
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return BBL_TRANSPORT_WOULD_BLOCK;
+    }
+
+    return result;
+}
+
+static ssize_t tcp_read(bbl_transport_t *transport, void *buf, size_t len)
+{
+    return tcp_result(recv(((bbl_tcp_t *)transport)->sock, buf, len, 0));
+}
+
+static ssize_t tcp_write(bbl_transport_t *transport, const void *buf, size_t len, bool more)
+{
+    int flags = 0;
+
+#ifdef MSG_MORE
+    // Lets lwIP hold back the tail segment instead of pushing it out half empty
+    if (more) {
+        flags |= MSG_MORE;
+    }
+#endif
+
+    return tcp_result(send(((bbl_tcp_t *)transport)->sock, buf, len, flags));
+}
+
+static size_t tcp_pending(bbl_transport_t *transport)
+{
+    // Nothing is buffered above the socket
+    (void)transport;
+
+    return 0;
+}
+
+static int tcp_sockfd(bbl_transport_t *transport)
+{
+    return ((bbl_tcp_t *)transport)->sock;
+}
+
+static void tcp_close(bbl_transport_t *transport)
+{
+    bbl_tcp_t *tcp = (bbl_tcp_t *)transport;
+
+    close(tcp->sock);
+    free(tcp);
+}
+
+static const bbl_transport_ops_t tcp_ops = {
+    .read       = tcp_read,
+    .write      = tcp_write,
+    .pending    = tcp_pending,
+    .sockfd     = tcp_sockfd,
+    .close      = tcp_close,
+};
+
+bbl_transport_t *bbl_tcp_connect(const char *host, uint16_t port, bool nodelay)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+    char port_str[6];
+    int sock;
+
+    bbl_snprintf(port_str, sizeof(port_str), "%u", port);
+    if (getaddrinfo(host, port_str, &hints, &res) != 0 || res == NULL) {
+        return NULL;
+    }
+
+    sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock < 0) {
+        freeaddrinfo(res);
+        return NULL;
+    }
+
+    if (connect(sock, res->ai_addr, res->ai_addrlen) != 0) {
+        freeaddrinfo(res);
+        close(sock);
+        return NULL;
+    }
+
+    freeaddrinfo(res);
+
+    int opt = nodelay;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+#if BBL_TCP_SNDBUF
+    opt = BBL_TCP_SNDBUF;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) != 0) {
+        BBL_LOG("Couldn't set the send buffer to %d bytes", opt);
+    }
+#endif
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    bbl_tcp_t *tcp = calloc(1, sizeof(*tcp));
+    if (tcp == NULL) {
+        close(sock);
+        return NULL;
+    }
+
+    tcp->transport.ops = &tcp_ops;
+    tcp->sock = sock;
+    return &tcp->transport;
+}
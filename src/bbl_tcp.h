@@ -0,0 +1,17 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __e2a97c54_81f3_4b6d_a0c8_53d1f94e7b20__
+#define __e2a97c54_81f3_4b6d_a0c8_53d1f94e7b20__
+
+#include "bbl_transport.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Plain lwIP socket transport, for brokers reached without TLS
+
+// Blocks for the lookup and connect; the socket is non-blocking afterwards.  nodelay disables
+// Nagle, which only delays us since the MQTT client already coalesces its writes.
+bbl_transport_t *bbl_tcp_connect(const char *host, uint16_t port, bool nodelay);
+
+#endif
@@ -0,0 +1,216 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_tls.h"
+#include "bbl_utils.h"
+#include "bbl_log.h"
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How long the blocking handshake waits on the server before giving up
+#ifndef BBL_TLS_HANDSHAKE_TIMEOUT_MS
+    #define BBL_TLS_HANDSHAKE_TIMEOUT_MS 10000
+#endif
+
+typedef struct bbl_tls bbl_tls_t;
+
+struct bbl_tls {
+    bbl_transport_t transport;
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    bool resumed;
+    uint32_t handshake_ms;
+};
+
+static bool tls_initialized;
+static mbedtls_entropy_context tls_entropy;
+static mbedtls_ctr_drbg_context tls_drbg;
+static mbedtls_ssl_config tls_conf;
+
+// The session from the last full or resumed handshake, and where it came from
+static mbedtls_ssl_session tls_session;
+static bool tls_session_valid;
+static char tls_session_host[64];
+static uint16_t tls_session_port;
+
+static bool tls_init()
+{
+    if (tls_initialized) {
+        return true;
+    }
+
+    mbedtls_entropy_init(&tls_entropy);
+    mbedtls_ctr_drbg_init(&tls_drbg);
+    mbedtls_ssl_config_init(&tls_conf);
+    mbedtls_ssl_session_init(&tls_session);
+
+    if (mbedtls_ctr_drbg_seed(&tls_drbg, mbedtls_entropy_func, &tls_entropy, NULL, 0) != 0 ||
+        mbedtls_ssl_config_defaults(&tls_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+    {
+        return false;
+    }
+
+    // Same as esp_tls without a CA certificate, which is what we used before
+    mbedtls_ssl_conf_authmode(&tls_conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&tls_conf, mbedtls_ctr_drbg_random, &tls_drbg);
+    mbedtls_ssl_conf_read_timeout(&tls_conf, BBL_TLS_HANDSHAKE_TIMEOUT_MS);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&tls_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+    tls_initialized = true;
+    return true;
+}
+
+static void tls_forget_session()
+{
+    mbedtls_ssl_session_free(&tls_session);
+    mbedtls_ssl_session_init(&tls_session);
+    tls_session_valid = false;
+}
+
+static bool tls_handshake(bbl_tls_t *tls, const char *host, uint16_t port)
+{
+    bool offered = tls_session_valid && tls_session_port == port && strcmp(tls_session_host, host) == 0;
+    uint32_t start = bbl_millis();
+    int result;
+
+    if (mbedtls_ssl_setup(&tls->ssl, &tls_conf) != 0 || mbedtls_ssl_set_hostname(&tls->ssl, host) != 0) {
+        return false;
+    }
+
+    // The socket is still blocking here, so a silent server would hang us without the timeout
+    mbedtls_ssl_set_bio(&tls->ssl, &tls->net, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+
+    if (offered) {
+        mbedtls_ssl_set_session(&tls->ssl, &tls_session);
+    }
+
+    while (tls->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        // The handshake state, and whether the server took our session, is freed by the last step
+        tls->resumed = tls->ssl.handshake != NULL && tls->ssl.handshake->resume;
+
+        result = mbedtls_ssl_handshake_step(&tls->ssl);
+        if (result != 0 && result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            // The saved session may be what the server choked on
+            tls_forget_session();
+            return false;
+        }
+    }
+
+    tls->handshake_ms = bbl_millis() - start;
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    mbedtls_ssl_get_session(&tls->ssl, &session);
+
+    tls_forget_session();
+    tls_session = session;
+    tls_session_valid = true;
+    tls_session_port = port;
+    strncpy(tls_session_host, host, sizeof(tls_session_host) - 1);
+    tls_session_host[sizeof(tls_session_host) - 1] = '\0';
+
+    BBL_LOG("TLS handshake took %u ms (%s)", tls->handshake_ms, tls->resumed ? "resumed" : "full");
+    return true;
+}
+
+// Close notifies and resets don't touch errno, so only mbedTLS's own answer says would-block
+static ssize_t tls_result(int result)
+{
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return BBL_TRANSPORT_WOULD_BLOCK;
+    }
+
+    return result;
+}
+
+static ssize_t tls_read(bbl_transport_t *transport, void *buf, size_t len)
+{
+    return tls_result(mbedtls_ssl_read(&((bbl_tls_t *)transport)->ssl, buf, len));
+}
+
+static ssize_t tls_write(bbl_transport_t *transport, const void *buf, size_t len, bool more)
+{
+    // Records are already as large as the output buffer makes them, so more changes nothing
+    (void)more;
+
+    return tls_result(mbedtls_ssl_write(&((bbl_tls_t *)transport)->ssl, buf, len));
+}
+
+static size_t tls_pending(bbl_transport_t *transport)
+{
+    return mbedtls_ssl_get_bytes_avail(&((bbl_tls_t *)transport)->ssl);
+}
+
+static int tls_sockfd(bbl_transport_t *transport)
+{
+    return ((bbl_tls_t *)transport)->net.fd;
+}
+
+static void tls_close(bbl_transport_t *transport)
+{
+    bbl_tls_t *tls = (bbl_tls_t *)transport;
+
+    mbedtls_ssl_close_notify(&tls->ssl);
+    mbedtls_ssl_free(&tls->ssl);
+    mbedtls_net_free(&tls->net);
+    free(tls);
+}
+
+static const bbl_transport_ops_t tls_ops = {
+    .read       = tls_read,
+    .write      = tls_write,
+    .pending    = tls_pending,
+    .sockfd     = tls_sockfd,
+    .close      = tls_close,
+};
+
+bbl_transport_t *bbl_tls_connect(const char *host, uint16_t port)
+{
+    char port_str[6];
+
+    if (!tls_init()) {
+        return NULL;
+    }
+
+    bbl_tls_t *tls = calloc(1, sizeof(*tls));
+    if (tls == NULL) {
+        return NULL;
+    }
+
+    tls->transport.ops = &tls_ops;
+    mbedtls_net_init(&tls->net);
+    mbedtls_ssl_init(&tls->ssl);
+
+    bbl_snprintf(port_str, sizeof(port_str), "%u", port);
+    if (mbedtls_net_connect(&tls->net, host, port_str, MBEDTLS_NET_PROTO_TCP) != 0 ||
+        !tls_handshake(tls, host, port))
+    {
+        mbedtls_ssl_free(&tls->ssl);
+        mbedtls_net_free(&tls->net);
+        free(tls);
+        return NULL;
+    }
+
+    // From here on the MQTT task's select() does the waiting
+    mbedtls_net_set_nonblock(&tls->net);
+    mbedtls_ssl_set_bio(&tls->ssl, &tls->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+    return &tls->transport;
+}
+
+uint32_t bbl_tls_handshake_ms(bbl_transport_t *transport)
+{
+    return ((bbl_tls_t *)transport)->handshake_ms;
+}
+
+bool bbl_tls_resumed(bbl_transport_t *transport)
+{
+    return ((bbl_tls_t *)transport)->resumed;
+}
@@ -0,0 +1,23 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __d3f0b8a6_5c2e_4a71_8e94_0b6c7f21a9d5__
+#define __d3f0b8a6_5c2e_4a71_8e94_0b6c7f21a9d5__
+
+#include "bbl_transport.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// TLS transport to the broker.  The session from the last successful handshake is kept and
+// offered again on the next connect to the same host, so a reconnect can skip the full handshake
+// when the server still remembers it.
+
+// Blocks for the TCP connect and TLS handshake, which gives up after BBL_TLS_HANDSHAKE_TIMEOUT_MS
+// without hearing from the server; the socket is non-blocking afterwards
+bbl_transport_t *bbl_tls_connect(const char *host, uint16_t port);
+
+// Only for transports returned by bbl_tls_connect
+uint32_t bbl_tls_handshake_ms(bbl_transport_t *transport);
+bool bbl_tls_resumed(bbl_transport_t *transport);
+
+#endif
@@ -0,0 +1,30 @@
+// Copyright (C) Jonathan Kolb
+
+#include "bbl_transport.h"
+
+ssize_t bbl_transport_read(bbl_transport_t *transport, void *buf, size_t len)
+{
+    return transport->ops->read(transport, buf, len);
+}
+
+ssize_t bbl_transport_write(bbl_transport_t *transport, const void *buf, size_t len, bool more)
+{
+    return transport->ops->write(transport, buf, len, more);
+}
+
+size_t bbl_transport_pending(bbl_transport_t *transport)
+{
+    return transport->ops->pending(transport);
+}
+
+int bbl_transport_sockfd(bbl_transport_t *transport)
+{
+    return transport->ops->sockfd(transport);
+}
+
+void bbl_transport_close(bbl_transport_t *transport)
+{
+    if (transport != NULL) {
+        transport->ops->close(transport);
+    }
+}
@@ -0,0 +1,42 @@
+// Copyright (C) Jonathan Kolb
+
+#ifndef __b5e81d3f_2a07_4c9e_9d16_6f3a0e7c24b8__
+#define __b5e81d3f_2a07_4c9e_9d16_6f3a0e7c24b8__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A connected, non-blocking byte stream to the broker.  Each transport embeds bbl_transport_t as
+// its first member and fills in ops, so the MQTT codec doesn't care whether it is talking TLS.
+
+// Below every mbedTLS error code, so it can't be mistaken for one
+#define BBL_TRANSPORT_WOULD_BLOCK (-0x10000)
+
+typedef struct bbl_transport bbl_transport_t;
+typedef struct bbl_transport_ops bbl_transport_ops_t;
+
+struct bbl_transport_ops {
+    // Both return the byte count, BBL_TRANSPORT_WOULD_BLOCK, or any other negative value for an
+    // error the connection won't recover from
+    ssize_t (*read)(bbl_transport_t *transport, void *buf, size_t len);
+    ssize_t (*write)(bbl_transport_t *transport, const void *buf, size_t len, bool more);
+    size_t (*pending)(bbl_transport_t *transport);
+    int (*sockfd)(bbl_transport_t *transport);
+    void (*close)(bbl_transport_t *transport);
+};
+
+struct bbl_transport {
+    const bbl_transport_ops_t *ops;
+};
+
+ssize_t bbl_transport_read(bbl_transport_t *transport, void *buf, size_t len);
+// more says another write follows right behind this one, so the transport may hold back a
+// partial segment
+ssize_t bbl_transport_write(bbl_transport_t *transport, const void *buf, size_t len, bool more);
+// Bytes already received and buffered above the socket, which select() cannot see
+size_t bbl_transport_pending(bbl_transport_t *transport);
+int bbl_transport_sockfd(bbl_transport_t *transport);
+void bbl_transport_close(bbl_transport_t *transport);
+
+#endif
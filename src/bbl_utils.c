@@ -16,6 +16,18 @@ void bbl_sleep(uint32_t ms)
     vTaskDelay(ms / portTICK_PERIOD_MS);
 }
 
+uint32_t bbl_fnv1a(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t hash = 2166136261u;
+
+    while (len-- > 0) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+
+    return hash;
+}
+
 size_t bbl_snprintf(char *buf, size_t bufsiz, const char *fmt, ...)
 {
     static const size_t UNSET_PRECISION = SIZE_MAX;
@@ -38,6 +38,7 @@
 
 uint32_t bbl_millis();
 void bbl_sleep(uint32_t ms);
+uint32_t bbl_fnv1a(const void *data, size_t len);
 size_t bbl_snprintf(char *buf, size_t bufsiz, const char *fmt, ...);
 
 #endif